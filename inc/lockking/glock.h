@@ -87,7 +87,9 @@ struct glock
 {
 	unsigned int has_internal_lock : 1;
 
-	const char _DUMMY_SEPARATOR; // separates has_internal_lock from mutex locked aftributes below
+	unsigned int is_process_shared : 1; // set if the counts were provided by the user (see initialize_process_shared_glock), and so are not freed on deinitialization
+
+	const char _DUMMY_SEPARATOR; // separates has_internal_lock and is_process_shared from mutex locked aftributes below
 
 	union{
 		pthread_mutex_t internal_lock;
@@ -97,12 +99,42 @@ struct glock
 	pthread_cond_t wait;
 	uint64_t waiters_count; // number of waiters waiting on the wait condition variable
 
-	uint64_t* locks_granted_count_per_lock_mode; // array of size lock_modes_count, 1 counter for each lock mode, this is dynamically allocated array
+	uint64_t* locks_granted_count_per_lock_mode; // array of size lock_modes_count, 1 counter for each lock mode, this is dynamically allocated array (or provided by the user for a process shared glock)
+
+	// slots for the state of the processes using a process shared glock, they follow the locks_granted_count_per_lock_mode in the array provided by the user
+	uint64_t* process_states;
+	uint64_t process_states_count;
 
 	const glock_matrix* gmatr;
 };
 
 int initialize_glock(glock* glock_p, const glock_matrix* gmatr, pthread_mutex_t* external_lock);
+
+/*
+	for a process shared glock, the counts are provided by the user in a single array of uint64_t-s, it is laid out as
+	[ locks_granted_count_per_lock_mode[lock_modes_count] ] followed by process_states_count slots of [ pid, waiters_count, locks_granted_count_per_lock_mode[lock_modes_count] ]
+	the slots account the counts of the glock per process, so that the locks held and waited for by a dead process can be rolled back
+*/
+
+// number of uint64_t-s in a slot for the state of a process
+#define GLOCK_PROCESS_STATE_SIZE(lock_modes_count) (UINT64_C(2) + MAKE_UINT64(lock_modes_count))
+
+// number of uint64_t-s in the counts array of a process shared glock
+#define GLOCK_PROCESS_SHARED_COUNTS_SIZE(lock_modes_count, process_states_count) (MAKE_UINT64(lock_modes_count) + (MAKE_UINT64(process_states_count) * GLOCK_PROCESS_STATE_SIZE(lock_modes_count)))
+
+/*
+	initializes a glock that can be used concurrently by multiple processes, it works just as initialize_process_shared_rwlock (see rwlock.h)
+	and recover_process_shared_glock has to be called just as recover_process_shared_rwlock
+	counts must point to an array of GLOCK_PROCESS_SHARED_COUNTS_SIZE(gmatr->lock_modes_count, process_states_count) uint64_t-s, it will not be freed on deinitialization
+	the gmatr and the counts must also reside in the shared memory segment, along with the glock
+	this function fails only if counts is NULL or process_states_count is 0
+*/
+int initialize_process_shared_glock(glock* glock_p, const glock_matrix* gmatr, pthread_mutex_t* external_lock, uint64_t* counts, uint64_t process_states_count);
+
+// returns the number of dead processes, whose state was rolled back
+// use it only with the external_lock held
+uint64_t recover_process_shared_glock(glock* glock_p);
+
 void deinitialize_glock(glock* glock_p);
 
 // the timeout_in_microseconds parameter can be (NON_BLOCKING, any positive integer or BLOCKING)
@@ -112,6 +144,9 @@ int glock_lock(glock* glock_p, uint64_t lock_mode, uint64_t timeout_in_microseco
 int glock_transition_lock(glock* glock_p, uint64_t old_lock_mode, uint64_t new_lock_mode, uint64_t timeout_in_microseconds);
 int glock_unlock(glock* glock_p, uint64_t lock_mode);
 
+// lock coupling (crabbing), it locks the child in child_lock_mode, and then releases the parent from parent_lock_mode, just as couple_rwlock (see rwlock.h)
+int glock_couple(glock* child_p, uint64_t child_lock_mode, glock* parent_p, uint64_t parent_lock_mode, int release_parent_before_blocking, uint64_t timeout_in_microseconds);
+
 // use the below 3 functions only with an external_lock held, else they give only instantaneous results
 
 int is_glock_locked(glock* glock_p);
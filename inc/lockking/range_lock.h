@@ -0,0 +1,91 @@
+#ifndef RANGE_LOCK_H
+#define RANGE_LOCK_H
+
+#include<pthread.h>
+#include<stdint.h>
+
+#include<posixutils/pthread_cond_utils.h>
+
+#include<lockking/rwlock.h> // using lock_preferring_type
+
+/*
+	range_lock is a reader writer lock over ranges [start, end) of an uint64_t key space (like file offsets or keys of an index)
+	two locked ranges conflict, only if they overlap and atleast one of them is a write lock
+	so a single range_lock replaces an array of per stripe rwlocks, and allows non-overlapping writers to proceed concurrently
+
+	the granted and waiting ranges are tracked in interval trees (treaps ordered by the start of the range, augmented with the max end in every subtree)
+	each waiter waits on its own condition variable, so a waiter is woken up only when a range that overlaps its own range is released
+*/
+
+// a range_lock_request is the handle for a single range that you lock and then unlock
+// it must be provided by the caller, and must stay valid (and must not be reused) until the corresponding range_*_unlock returns
+// you may allocate it on the stack of the thread that locks and unlocks the range
+typedef struct range_lock_request range_lock_request;
+struct range_lock_request
+{
+	uint64_t start; // inclusive
+	uint64_t end;   // exclusive
+
+	// below attributes are for internal use only, they make this request a node of one of the interval trees of the range_lock
+
+	range_lock_request* left;
+	range_lock_request* right;
+
+	uint64_t priority; // heap priority of this node in the treap
+
+	uint64_t max_end; // max of the end of all the ranges in the subtree rooted at this node
+
+	pthread_cond_t wait; // the thread waits here, it is initialized only while this request is waiting
+};
+
+typedef struct range_lock range_lock;
+struct range_lock
+{
+	unsigned int has_internal_lock : 1;
+
+	const char _DUMMY_SEPARATOR; // separates has_internal_lock from mutex locked aftributes below
+
+	// roots of the interval trees of the granted ranges
+	range_lock_request* read_locked;
+	range_lock_request* write_locked;
+
+	// roots of the interval trees of the ranges waiting to be granted
+	range_lock_request* read_waiting;
+	range_lock_request* write_waiting;
+
+	uint64_t priority_seed; // used to generate the treap priorities of the nodes
+
+	union{
+		pthread_mutex_t internal_lock;
+		pthread_mutex_t* external_lock;
+	};
+};
+
+void initialize_range_lock(range_lock* range_lock_p, pthread_mutex_t* external_lock);
+void deinitialize_range_lock(range_lock* range_lock_p);
+
+// the timeout_in_microseconds parameter can be (NON_BLOCKING, any positive integer or BLOCKING)
+
+// *_lock functions may fail if NON_BLOCKING or if timeout_in_microseconds expired and the lock could not be taken
+// they also fail for an empty range i.e. if (start >= end)
+// the preferring parameter has the same meaning as for the read_lock of the rwlock, but only for the overlapping writers
+// range_lock does not keep the state for ADAPTIVE_PREFERRING and PHASE_FAIR, so they are treated as WRITE_PREFERRING
+int range_read_lock(range_lock* range_lock_p, range_lock_request* request_p, uint64_t start, uint64_t end, lock_preferring_type preferring, uint64_t timeout_in_microseconds);
+int range_write_lock(range_lock* range_lock_p, range_lock_request* request_p, uint64_t start, uint64_t end, uint64_t timeout_in_microseconds);
+
+// *_unlock functions never block
+// they fail if the request_p is not currently holding the lock in the corresponding mode
+
+int range_read_unlock(range_lock* range_lock_p, range_lock_request* request_p);
+int range_write_unlock(range_lock* range_lock_p, range_lock_request* request_p);
+
+// use the below 4 functions only with an external_lock held, else they give only instantaneous results
+
+// check if any part of the range [start, end) is read or write locked
+int is_range_read_locked(range_lock* range_lock_p, uint64_t start, uint64_t end);
+int is_range_write_locked(range_lock* range_lock_p, uint64_t start, uint64_t end);
+
+int has_range_lock_waiters(range_lock* range_lock_p);
+int is_range_lock_referenced(range_lock* range_lock_p);
+
+#endif
@@ -3,17 +3,58 @@
 
 #include<pthread.h>
 #include<stdint.h>
+#include<sys/types.h>
 
 #include<posixutils/pthread_cond_utils.h>
 
 // rwlock assumes that the thread count in your application will never be more than UINT64_MAX
 
+// a closure is a function with its arguments, to be executed with the rwlock held, see execute_with_*_lock functions
+// it must be provided by the caller, and must stay valid until the execute_with_*_lock function returns
+typedef struct rwlock_closure rwlock_closure;
+struct rwlock_closure
+{
+	void* (*function)(void* args);
+	void* args;
+
+	void* result; // return value of the function, set only if it was executed
+
+	// below attributes are for internal use only
+
+	rwlock_closure* next;
+
+	int is_taken; // set when a combiner takes this closure for execution, it can not be cancelled after this
+	int is_done; // set after a combiner executed this closure
+
+	pthread_cond_t wait; // the thread waits here, it is initialized only while the closure is published and waiting
+};
+
+// for a process shared rwlock, the counts of the rwlock are also accounted per process, in an array of these slots
+// so that the locks held and waited for by a dead process can be rolled back
+// an unused slot has its pid set to 0, a slot is claimed by a process for the duration it holds or waits for the rwlock
+typedef struct rwlock_process_state rwlock_process_state;
+struct rwlock_process_state
+{
+	pid_t pid;
+
+	uint64_t readers_count;
+	uint64_t writers_count;
+	uint64_t upgraders_waiting_count;
+	uint64_t readers_waiting_count;
+	uint64_t writers_waiting_count;
+	uint64_t adaptive_readers_waiting_count;
+	uint64_t phase_fair_readers_waiting_count;
+	uint64_t phase_fair_readers_entitled_count;
+};
+
 typedef struct rwlock rwlock;
 struct rwlock
 {
 	unsigned int has_internal_lock : 1;
 
-	const char _DUMMY_SEPARATOR; // separates has_internal_lock from mutex locked aftributes below
+	unsigned int is_process_shared : 1;
+
+	const char _DUMMY_SEPARATOR; // separates has_internal_lock and is_process_shared from mutex locked aftributes below
 
 	unsigned int writers_count : 1;
 	unsigned int upgraders_waiting_count : 1;
@@ -22,17 +63,63 @@ struct rwlock
 	uint64_t readers_waiting_count;
 	uint64_t writers_waiting_count;
 
+	// below attributes are used only to decide the effective policy for the ADAPTIVE_PREFERRING readers
+
+	uint64_t adaptive_readers_waiting_count; // number of ADAPTIVE_PREFERRING readers in readers_waiting_count
+	uint64_t readers_bypassing_writers_count; // number of ADAPTIVE_PREFERRING readers granted the lock while writers (or an upgrader) were waiting, since a writer was last granted the lock
+	uint64_t writers_waiting_since; // time (CLOCK_MONOTONIC, in microseconds) since when the waiting writers (or an upgrader) have been waiting without a writer being granted the lock
+	uint64_t read_arrivals_count; // number of read_lock calls since the last write_lock call
+	uint64_t readers_per_writer; // moving average of the read_arrivals_count, sampled at every write_lock call, in fixed point (scaled by 16), so that the small ratios are not truncated away
+
+	// below attributes are used only for the PHASE_FAIR readers
+
+	uint64_t write_phases_count; // number of times a writer released the lock (by unlocking or downgrading it)
+	uint64_t phase_fair_readers_waiting_count; // number of PHASE_FAIR readers in readers_waiting_count
+	uint64_t phase_fair_readers_entitled_count; // number of waiting PHASE_FAIR readers, that were waiting when the last write phase ended, writers wait for them to enter
+
+	// publication list of the closures waiting to be executed with the write lock held, by a combiner
+	rwlock_closure* closures_head;
+	rwlock_closure* closures_tail;
+
+	// slots for the state of the processes using a process shared rwlock
+	rwlock_process_state* process_states;
+	uint64_t process_states_count;
+
 	union{
 		pthread_mutex_t internal_lock;
 		pthread_mutex_t* external_lock;
 	};
 
 	pthread_cond_t read_wait; // readers wait here
+	pthread_cond_t adaptive_read_wait; // ADAPTIVE_PREFERRING readers wait here
 	pthread_cond_t write_wait; // writers wait here
 	pthread_cond_t upgrade_wait; // upgrader waits here
 };
 
 void initialize_rwlock(rwlock* rwlock_p, pthread_mutex_t* external_lock);
+
+/*
+	initializes an rwlock that can be used concurrently by multiple processes, when it resides in a shared memory segment
+	the internal lock is a process shared robust mutex, and the waiters wait on futex words (placed in the condition variables), as a process shared pthread_cond_t can not survive the death of a waiting process
+	process_states must point to an array of process_states_count slots, this bounds the number of processes that may concurrently hold or wait for this rwlock
+	the rwlock, the process_states and the external_lock (if any, it must be a process shared robust mutex)
+	all must reside in the shared memory segment mapped at the same address in all the processes
+	this function fails only if process_states is NULL or process_states_count is 0
+
+	the locks held and waited for by a dead process are rolled back by recover_process_shared_rwlock
+	it is called internally, when the internal lock is found to be held by a dead process (EOWNERDEAD), and when all the slots are in use
+	you must call it yourself, after you reap a child process that may have been using this rwlock
+	and if you use an external_lock, you must call it (for every rwlock using it), after locking the external_lock fails with EOWNERDEAD, and before making it consistent
+	the external_lock is never made consistent by this library, a call that gets it back with EOWNERDEAD (while blocking) fails with errno set to EOWNERDEAD
+	then you still hold the external_lock, and must recover it as above, as releasing it without making it consistent makes it unusable
+	NOTE :: a lock must be unlocked by the same process that locked it, and a pid reused by a new process inherits the slot of the dead process, if it was not yet recovered
+*/
+int initialize_process_shared_rwlock(rwlock* rwlock_p, pthread_mutex_t* external_lock, rwlock_process_state* process_states, uint64_t process_states_count);
+
+// returns the number of dead processes, whose state was rolled back
+// use it only with the external_lock held
+uint64_t recover_process_shared_rwlock(rwlock* rwlock_p);
+
 void deinitialize_rwlock(rwlock* rwlock_p);
 
 // majorly the api only has below 6 functions
@@ -42,8 +129,29 @@ enum lock_preferring_type
 {
 	READ_PREFERRING,
 	WRITE_PREFERRING,
+	ADAPTIVE_PREFERRING,
+	PHASE_FAIR,
 };
 
+/*
+	an ADAPTIVE_PREFERRING reader behaves READ_PREFERRING-ly, until it sees writers (or an upgrader) waiting for the lock
+	then it continues to bypass them, only until (readers_per_writer) readers have bypassed them, after which it behaves WRITE_PREFERRING-ly
+	so a waiting writer is overtaken by atmost as many readers as arrive per writer on an average (clamped between 1 and RWLOCK_ADAPTIVE_MAX_READERS_BYPASSING_WRITERS)
+	and no reader bypasses the waiting writers, once they have waited for RWLOCK_ADAPTIVE_MAX_WRITERS_WAIT_IN_MICROSECONDS without a writer being granted the lock
+	the waiting ADAPTIVE_PREFERRING readers are woken up along with the writers, every time a writer releases the lock, so they get to bypass them again
+	i.e. during read storms readers keep their throughput, while during write heavy loads the writers are not starved by readers
+*/
+#define RWLOCK_ADAPTIVE_MAX_READERS_BYPASSING_WRITERS UINT64_C(64)
+#define RWLOCK_ADAPTIVE_MAX_WRITERS_WAIT_IN_MICROSECONDS UINT64_C(1000)
+
+/*
+	with PHASE_FAIR readers, the read and the write phases alternate
+	a PHASE_FAIR reader arriving while writers (or an upgrader) are waiting, waits like a WRITE_PREFERRING reader, so that the current read phase can end
+	and when the write phase ends, all the PHASE_FAIR readers waiting at that moment are admitted together, even if there are other writers waiting
+	the writers (and an upgrader) then wait only for these admitted readers to enter and release the lock
+	so a PHASE_FAIR reader waits for atmost one write phase, and a writer waits for atmost one read phase (besides the writers queued before it)
+*/
+
 // the timeout_in_microseconds parameter can be (NON_BLOCKING, any positive integer or BLOCKING)
 
 // *_lock and upgrade lock functions may fail if NON_BLOCKING or if timeout_in_microseconds expired and the lock could not be taken
@@ -62,6 +170,49 @@ int downgrade_lock(rwlock* rwlock_p);
 int read_unlock(rwlock* rwlock_p);
 int write_unlock(rwlock* rwlock_p);
 
+/*
+	lock coupling (crabbing), to descend from a parent node to its child node in a tree, with each node protected by its own rwlock
+	it locks the child in child_mode, and then releases the parent (that you must be holding) in parent_mode
+	if release_parent_before_blocking is not set, then the parent is released only if the child was locked, else it continues to be held
+	if release_parent_before_blocking is set, then the parent is always released, and it is released before you block for the child (for optimistic descents)
+	on a failure in this case, you hold neither of the locks and may have to restart the descent
+	the internal locks of the child and the parent are held together (taken in the order of their addresses), so the child is locked and the parent is released atomically, if the child is available
+	with external_locks, the caller must hold the external_locks of both of them, and if they share an external_lock, the whole operation happens under that single (held) external_lock
+	it returns 1, only if the child was locked
+*/
+
+typedef enum rwlock_mode rwlock_mode;
+enum rwlock_mode
+{
+	RWLOCK_READ_MODE,
+	RWLOCK_WRITE_MODE,
+};
+
+// child_preferring is used only if the child_mode is RWLOCK_READ_MODE
+int couple_rwlock(rwlock* child_p, rwlock_mode child_mode, lock_preferring_type child_preferring, rwlock* parent_p, rwlock_mode parent_mode, int release_parent_before_blocking, uint64_t timeout_in_microseconds);
+
+/*
+	execute_with_*_lock functions execute the function of the closure, with the rwlock held in the corresponding mode
+	they return 1 only if the function was executed, and then its return value is in the closure_p->result
+	with an external_lock, it is released while the function executes (and while blocking), and is held again on return
+
+	execute_with_read_lock simply executes the function on the calling thread, concurrently with other readers
+	execute_with_write_lock uses flat combining, when the write lock is not available, the closure is published to the rwlock
+	then whichever thread gets the write lock next (the combiner), executes all the published closures in batches, and hands back their results
+	so the protected data stays in the combiner's cache, instead of moving between the cores of the threads contending for the lock
+	when uncontended, the calling thread just becomes the combiner and executes its own closure, just as with ordinary locking
+	waiting for the closure is counted as a waiting writer, and it fails only if it times out before any combiner took it for execution
+	execute_with_write_lock always fails for a process shared rwlock, as a combiner can not execute the functions (and wake up the threads) of another process
+	if the external_lock is found held by a dead owner after the function was executed, the call still succeeds, but with errno set to EOWNERDEAD
+	only a thread waiting for its taken closure, makes such an external_lock consistent itself, as the combiner needs it to hand over the result
+*/
+
+// the number of batches that a combiner executes, before releasing the write lock
+#define RWLOCK_MAX_COMBINING_ROUNDS UINT64_C(4)
+
+int execute_with_read_lock(rwlock* rwlock_p, lock_preferring_type preferring, rwlock_closure* closure_p, uint64_t timeout_in_microseconds);
+int execute_with_write_lock(rwlock* rwlock_p, rwlock_closure* closure_p, uint64_t timeout_in_microseconds);
+
 // use the below 4 functions only with an external_lock held, else they give only instantaneous results
 
 int is_read_locked(rwlock* rwlock_p);
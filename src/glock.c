@@ -2,6 +2,10 @@
 
 #include<stdlib.h>
 #include<string.h>
+#include<errno.h>
+#include<unistd.h>
+
+#include"process_shared_utils.h"
 
 // for internal use only
 static inline int are_glock_modes_compatible_UNSAFE(const glock_matrix* gmatr, uint64_t M1, uint64_t M2)
@@ -30,12 +34,193 @@ static inline pthread_mutex_t* get_glock_lock(glock* glock_p)
 		return glock_p->external_lock;
 }
 
+// accessors for the slot of a process, see the layout of the counts of a process shared glock in glock.h
+#define PROCESS_STATE_PID(process_state_p)                         ((process_state_p)[0])
+#define PROCESS_STATE_WAITERS_COUNT(process_state_p)               ((process_state_p)[1])
+#define PROCESS_STATE_LOCKS_GRANTED_COUNT(process_state_p, lock_mode) ((process_state_p)[2 + (lock_mode)])
+
+static inline uint64_t* get_process_state_at(glock* glock_p, uint64_t i)
+{
+	return glock_p->process_states + (i * GLOCK_PROCESS_STATE_SIZE(glock_p->gmatr->lock_modes_count));
+}
+
+// the below counts of a process shared glock are also accounted in the slot of the calling process
+// process_state_p is NULL for a glock that is not process shared
+
+static inline void increment_waiters_count(glock* glock_p, uint64_t* process_state_p)
+{
+	glock_p->waiters_count++;
+	if(process_state_p != NULL)
+		PROCESS_STATE_WAITERS_COUNT(process_state_p)++;
+}
+
+static inline void decrement_waiters_count(glock* glock_p, uint64_t* process_state_p)
+{
+	glock_p->waiters_count--;
+	if(process_state_p != NULL)
+		PROCESS_STATE_WAITERS_COUNT(process_state_p)--;
+}
+
+static inline void increment_locks_granted_count(glock* glock_p, uint64_t* process_state_p, uint64_t lock_mode)
+{
+	glock_p->locks_granted_count_per_lock_mode[lock_mode]++;
+	if(process_state_p != NULL)
+		PROCESS_STATE_LOCKS_GRANTED_COUNT(process_state_p, lock_mode)++;
+}
+
+static inline void decrement_locks_granted_count(glock* glock_p, uint64_t* process_state_p, uint64_t lock_mode)
+{
+	glock_p->locks_granted_count_per_lock_mode[lock_mode]--;
+	if(process_state_p != NULL)
+		PROCESS_STATE_LOCKS_GRANTED_COUNT(process_state_p, lock_mode)--;
+}
+
+// a process shared glock waits on the futex word placed in its condition variable, see process_shared_utils.h
+static inline void broadcast_glock_waiters(glock* glock_p)
+{
+	if(glock_p->is_process_shared)
+		wake_up_process_shared_waiters((uint32_t*)(&(glock_p->wait)), 1);
+	else
+		pthread_cond_broadcast(&(glock_p->wait));
+}
+
+static uint64_t recover_dead_processes(glock* glock_p)
+{
+	uint64_t recovered_count = 0;
+	for(uint64_t i = 0; i < glock_p->process_states_count; i++)
+	{
+		uint64_t* process_state_p = get_process_state_at(glock_p, i);
+		if(PROCESS_STATE_PID(process_state_p) != 0 && !is_process_alive((pid_t)PROCESS_STATE_PID(process_state_p)))
+		{
+			memset(process_state_p, 0, sizeof(uint64_t) * GLOCK_PROCESS_STATE_SIZE(glock_p->gmatr->lock_modes_count));
+			recovered_count++;
+		}
+	}
+
+	if(recovered_count == 0)
+		return 0;
+
+	// the counts of the glock are the sums of the counts of the live processes
+	// this also undoes a partial update, by a process that died while holding the glock's mutex
+	glock_p->waiters_count = 0;
+	memset(glock_p->locks_granted_count_per_lock_mode, 0, sizeof(uint64_t) * glock_p->gmatr->lock_modes_count);
+	for(uint64_t i = 0; i < glock_p->process_states_count; i++)
+	{
+		const uint64_t* process_state_p = get_process_state_at(glock_p, i);
+		glock_p->waiters_count += PROCESS_STATE_WAITERS_COUNT(process_state_p);
+		for(uint64_t m = 0; m < glock_p->gmatr->lock_modes_count; m++)
+			glock_p->locks_granted_count_per_lock_mode[m] += PROCESS_STATE_LOCKS_GRANTED_COUNT(process_state_p, m);
+	}
+
+	// wake up everyone, to recheck the lock state without the dead processes
+	broadcast_glock_waiters(glock_p);
+
+	return recovered_count;
+}
+
+// if a process dies while holding the robust mutex of a process shared glock, the mutex is granted to the next locker with EOWNERDEAD
+// then the state of the dead process is rolled back, before making the mutex consistent
+// use it only for the internal lock, an external_lock made consistent here would hide the dead owner from the caller, that must recover all the locks using it
+static inline void lock_glock_lock(glock* glock_p)
+{
+	if(pthread_mutex_lock(get_glock_lock(glock_p)) == EOWNERDEAD)
+	{
+		recover_dead_processes(glock_p);
+		pthread_mutex_consistent(get_glock_lock(glock_p));
+	}
+}
+
+// the same as lock_glock_lock, but it does not block, it returns 1 only if the internal lock was taken
+static inline int trylock_glock_lock(glock* glock_p)
+{
+	int lock_error = pthread_mutex_trylock(get_glock_lock(glock_p));
+	if(lock_error == EOWNERDEAD)
+	{
+		recover_dead_processes(glock_p);
+		pthread_mutex_consistent(get_glock_lock(glock_p));
+		return 1;
+	}
+	return lock_error == 0;
+}
+
+static inline int timedwait_on_glock(glock* glock_p, uint64_t* timeout_in_microseconds)
+{
+	int wait_error;
+	if(glock_p->is_process_shared)
+		wait_error = process_shared_timedwait_for_microseconds((uint32_t*)(&(glock_p->wait)), get_glock_lock(glock_p), timeout_in_microseconds);
+	else
+		wait_error = pthread_cond_timedwait_for_microseconds(&(glock_p->wait), get_glock_lock(glock_p), timeout_in_microseconds);
+	if(wait_error == EOWNERDEAD)
+	{
+		if(glock_p->has_internal_lock)
+		{
+			recover_dead_processes(glock_p);
+			pthread_mutex_consistent(get_glock_lock(glock_p));
+			wait_error = 0;
+		}
+		else // the external_lock is left inconsistent, the call fails and the caller must recover it
+			errno = EOWNERDEAD;
+	}
+	return wait_error;
+}
+
+// returns the slot of the calling process, claiming a new one if necessary, it returns NULL only if all the slots are in use
+static uint64_t* get_process_state(glock* glock_p)
+{
+	uint64_t pid = (uint64_t)getpid();
+
+	uint64_t* unused_process_state_p = NULL;
+	for(uint64_t i = 0; i < glock_p->process_states_count; i++)
+	{
+		uint64_t* process_state_p = get_process_state_at(glock_p, i);
+		if(PROCESS_STATE_PID(process_state_p) == pid)
+			return process_state_p;
+		if(unused_process_state_p == NULL && PROCESS_STATE_PID(process_state_p) == 0)
+			unused_process_state_p = process_state_p;
+	}
+
+	// all slots are in use, try to free the slots of the dead processes
+	if(unused_process_state_p == NULL && recover_dead_processes(glock_p) > 0)
+	{
+		for(uint64_t i = 0; i < glock_p->process_states_count && unused_process_state_p == NULL; i++)
+		{
+			if(PROCESS_STATE_PID(get_process_state_at(glock_p, i)) == 0)
+				unused_process_state_p = get_process_state_at(glock_p, i);
+		}
+	}
+
+	if(unused_process_state_p != NULL)
+		PROCESS_STATE_PID(unused_process_state_p) = pid;
+	return unused_process_state_p;
+}
+
+// releases the slot of the calling process, if it neither holds nor waits for the glock
+static inline void put_process_state(glock* glock_p, uint64_t* process_state_p)
+{
+	if(process_state_p == NULL)
+		return;
+	if(PROCESS_STATE_WAITERS_COUNT(process_state_p) > 0)
+		return;
+	for(uint64_t m = 0; m < glock_p->gmatr->lock_modes_count; m++)
+	{
+		if(PROCESS_STATE_LOCKS_GRANTED_COUNT(process_state_p, m) > 0)
+			return;
+	}
+	PROCESS_STATE_PID(process_state_p) = 0;
+}
+
+// acquires the slot of the calling process for a process shared glock, it fails only if all the slots are in use
+#define ACQUIRE_PROCESS_STATE(glock_p, process_state_p) ((!(glock_p)->is_process_shared) || (((process_state_p) = get_process_state(glock_p)) != NULL))
+
 int initialize_glock(glock* glock_p, const glock_matrix* gmatr, pthread_mutex_t* external_lock)
 {
 	glock_p->locks_granted_count_per_lock_mode = malloc(sizeof(uint64_t) * gmatr->lock_modes_count);
 	if(glock_p->locks_granted_count_per_lock_mode == NULL)
 		return 0;
 	memset(glock_p->locks_granted_count_per_lock_mode, 0, sizeof(uint64_t) * gmatr->lock_modes_count);
+	glock_p->is_process_shared = 0;
+	glock_p->process_states = NULL;
+	glock_p->process_states_count = 0;
 
 	glock_p->gmatr = gmatr;
 	if(external_lock)
@@ -53,12 +238,56 @@ int initialize_glock(glock* glock_p, const glock_matrix* gmatr, pthread_mutex_t*
 	return 1;
 }
 
+int initialize_process_shared_glock(glock* glock_p, const glock_matrix* gmatr, pthread_mutex_t* external_lock, uint64_t* counts, uint64_t process_states_count)
+{
+	if(counts == NULL || process_states_count == 0)
+		return 0;
+	memset(counts, 0, sizeof(uint64_t) * GLOCK_PROCESS_SHARED_COUNTS_SIZE(gmatr->lock_modes_count, process_states_count));
+	glock_p->locks_granted_count_per_lock_mode = counts;
+	glock_p->is_process_shared = 1;
+	glock_p->process_states = counts + gmatr->lock_modes_count;
+	glock_p->process_states_count = process_states_count;
+
+	glock_p->gmatr = gmatr;
+	if(external_lock)
+	{
+		glock_p->has_internal_lock = 0;
+		glock_p->external_lock = external_lock;
+	}
+	else
+	{
+		glock_p->has_internal_lock = 1;
+		pthread_mutex_init_process_shared_robust(&(glock_p->internal_lock));
+	}
+	glock_p->waiters_count = 0;
+	memset(&(glock_p->wait), 0, sizeof(pthread_cond_t)); // the condition variable is used as a futex word
+	return 1;
+}
+
+uint64_t recover_process_shared_glock(glock* glock_p)
+{
+	if(!glock_p->is_process_shared)
+		return 0;
+
+	if(glock_p->has_internal_lock)
+		lock_glock_lock(glock_p);
+
+	uint64_t res = recover_dead_processes(glock_p);
+
+	if(glock_p->has_internal_lock)
+		pthread_mutex_unlock(get_glock_lock(glock_p));
+
+	return res;
+}
+
 void deinitialize_glock(glock* glock_p)
 {
-	free(glock_p->locks_granted_count_per_lock_mode);
+	if(!glock_p->is_process_shared)
+		free(glock_p->locks_granted_count_per_lock_mode);
 	if(glock_p->has_internal_lock)
 		pthread_mutex_destroy(&(glock_p->internal_lock));
-	pthread_cond_destroy(&(glock_p->wait));
+	if(!glock_p->is_process_shared)
+		pthread_cond_destroy(&(glock_p->wait));
 }
 
 // lock_mde must be within bounds
@@ -74,7 +303,9 @@ static inline int can_grab_lock(const glock* glock_p, uint64_t lock_mode)
 	return 1;
 }
 
-int glock_lock(glock* glock_p, uint64_t lock_mode, uint64_t timeout_in_microseconds)
+// the *_UNSAFE functions must be called with the glock's mutex held, the public functions are their wrappers, that lock the internal lock if any
+
+static int glock_lock_UNSAFE(glock* glock_p, uint64_t lock_mode, uint64_t timeout_in_microseconds)
 {
 	// lock_mode must be within bounds
 	if(lock_mode >= glock_p->gmatr->lock_modes_count)
@@ -82,26 +313,42 @@ int glock_lock(glock* glock_p, uint64_t lock_mode, uint64_t timeout_in_microseco
 
 	int res = 0;
 
-	if(glock_p->has_internal_lock)
-		pthread_mutex_lock(get_glock_lock(glock_p));
+	uint64_t* process_state_p = NULL;
+	if(!ACQUIRE_PROCESS_STATE(glock_p, process_state_p))
+		goto EXIT;
 
+	int wait_error = 0;
+	while(!can_grab_lock(glock_p, lock_mode) && !wait_error) // block while you can not grab lock and there is no wait error
 	{
-		int wait_error = 0;
-		while(!can_grab_lock(glock_p, lock_mode) && !wait_error) // block while you can not grab lock and there is no wait error
-		{
-			glock_p->waiters_count++;
-			wait_error = pthread_cond_timedwait_for_microseconds(&(glock_p->wait), get_glock_lock(glock_p), &timeout_in_microseconds);
-			glock_p->waiters_count--;
-		}
+		increment_waiters_count(glock_p, process_state_p);
+		wait_error = timedwait_on_glock(glock_p, &timeout_in_microseconds);
+		decrement_waiters_count(glock_p, process_state_p);
 	}
 
+	// the external_lock was held by a dead process, its waiters get woken up when the caller recovers it
+	if(wait_error == EOWNERDEAD)
+		goto EXIT;
+
 	// if you can grab a lock, then grab it, else fail
 	if(can_grab_lock(glock_p, lock_mode))
 	{
-		glock_p->locks_granted_count_per_lock_mode[lock_mode]++;
+		increment_locks_granted_count(glock_p, process_state_p, lock_mode);
 		res = 1;
 	}
 
+	EXIT:;
+	put_process_state(glock_p, process_state_p);
+
+	return res;
+}
+
+int glock_lock(glock* glock_p, uint64_t lock_mode, uint64_t timeout_in_microseconds)
+{
+	if(glock_p->has_internal_lock)
+		lock_glock_lock(glock_p);
+
+	int res = glock_lock_UNSAFE(glock_p, lock_mode, timeout_in_microseconds);
+
 	if(glock_p->has_internal_lock)
 		pthread_mutex_unlock(get_glock_lock(glock_p));
 
@@ -139,10 +386,14 @@ int glock_transition_lock(glock* glock_p, uint64_t old_lock_mode, uint64_t new_l
 	int res = 0;
 
 	if(glock_p->has_internal_lock)
-		pthread_mutex_lock(get_glock_lock(glock_p));
+		lock_glock_lock(glock_p);
+
+	uint64_t* process_state_p = NULL;
+	if(!ACQUIRE_PROCESS_STATE(glock_p, process_state_p))
+		goto EXIT;
 
-	// make sure that the resource is locked
-	if(glock_p->locks_granted_count_per_lock_mode[old_lock_mode] == 0)
+	// make sure that the resource is locked (by this process, if it is process shared)
+	if(glock_p->locks_granted_count_per_lock_mode[old_lock_mode] == 0 || (process_state_p != NULL && PROCESS_STATE_LOCKS_GRANTED_COUNT(process_state_p, old_lock_mode) == 0))
 		goto EXIT;
 
 	// edge case : if old_lock_mode was same as the new_lock_mode to transition into, then succeed immediately without waking anyone up
@@ -152,36 +403,40 @@ int glock_transition_lock(glock* glock_p, uint64_t old_lock_mode, uint64_t new_l
 		goto EXIT;
 	}
 
+	int wait_error = 0;
+	while(!can_transition_lock(glock_p, old_lock_mode, new_lock_mode) && !wait_error) // block while you can not transition lock and there is no wait error
 	{
-		int wait_error = 0;
-		while(!can_transition_lock(glock_p, old_lock_mode, new_lock_mode) && !wait_error) // block while you can not transition lock and there is no wait error
-		{
-			glock_p->waiters_count++;
-			wait_error = pthread_cond_timedwait_for_microseconds(&(glock_p->wait), get_glock_lock(glock_p), &timeout_in_microseconds);
-			glock_p->waiters_count--;
-		}
+		increment_waiters_count(glock_p, process_state_p);
+		wait_error = timedwait_on_glock(glock_p, &timeout_in_microseconds);
+		decrement_waiters_count(glock_p, process_state_p);
 	}
 
+	// the external_lock was held by a dead process, its waiters get woken up when the caller recovers it
+	if(wait_error == EOWNERDEAD)
+		goto EXIT;
+
 	if(can_transition_lock(glock_p, old_lock_mode, new_lock_mode))
 	{
 		// transition the lock
-		glock_p->locks_granted_count_per_lock_mode[old_lock_mode]--;
-		glock_p->locks_granted_count_per_lock_mode[new_lock_mode]++;
+		decrement_locks_granted_count(glock_p, process_state_p, old_lock_mode);
+		increment_locks_granted_count(glock_p, process_state_p, new_lock_mode);
 		res = 1;
 
 		// wake up any waiters, we changed lock_mode, there could be some lock_mode waiter that could have become compatible with other threads
 		if(glock_p->waiters_count > 0)
-			pthread_cond_broadcast(&(glock_p->wait));
+			broadcast_glock_waiters(glock_p);
 	}
 
 	EXIT:;
+	put_process_state(glock_p, process_state_p);
+
 	if(glock_p->has_internal_lock)
 		pthread_mutex_unlock(get_glock_lock(glock_p));
 
 	return res;
 }
 
-int glock_unlock(glock* glock_p, uint64_t lock_mode)
+static int glock_unlock_UNSAFE(glock* glock_p, uint64_t lock_mode)
 {
 	// lock_mode must be within bounds
 	if(lock_mode >= glock_p->gmatr->lock_modes_count)
@@ -189,32 +444,113 @@ int glock_unlock(glock* glock_p, uint64_t lock_mode)
 
 	int res = 0;
 
-	if(glock_p->has_internal_lock)
-		pthread_mutex_lock(get_glock_lock(glock_p));
+	uint64_t* process_state_p = NULL;
+	if(!ACQUIRE_PROCESS_STATE(glock_p, process_state_p))
+		goto EXIT;
 
-	// make sure that the resource is locked
-	if(glock_p->locks_granted_count_per_lock_mode[lock_mode] == 0)
+	// make sure that the resource is locked (by this process, if it is process shared)
+	if(glock_p->locks_granted_count_per_lock_mode[lock_mode] == 0 || (process_state_p != NULL && PROCESS_STATE_LOCKS_GRANTED_COUNT(process_state_p, lock_mode) == 0))
 		goto EXIT;
 
 	// decrement the locks_granted_count, releasing lock for the specific lock_mode
-	glock_p->locks_granted_count_per_lock_mode[lock_mode]--;
+	decrement_locks_granted_count(glock_p, process_state_p, lock_mode);
 	res = 1;
 
 	// wake up any waiters
 	if(glock_p->waiters_count > 0)
-		pthread_cond_broadcast(&(glock_p->wait));
+		broadcast_glock_waiters(glock_p);
 
 	EXIT:;
+	put_process_state(glock_p, process_state_p);
+
+	return res;
+}
+
+int glock_unlock(glock* glock_p, uint64_t lock_mode)
+{
+	if(glock_p->has_internal_lock)
+		lock_glock_lock(glock_p);
+
+	int res = glock_unlock_UNSAFE(glock_p, lock_mode);
+
 	if(glock_p->has_internal_lock)
 		pthread_mutex_unlock(get_glock_lock(glock_p));
 
 	return res;
 }
 
+// returns the mutex that this call must lock for the glock, NULL if it has an external_lock (that the caller holds)
+static inline pthread_mutex_t* get_glock_internal_lock(glock* glock_p)
+{
+	return glock_p->has_internal_lock ? &(glock_p->internal_lock) : NULL;
+}
+
+int glock_couple(glock* child_p, uint64_t child_lock_mode, glock* parent_p, uint64_t parent_lock_mode, int release_parent_before_blocking, uint64_t timeout_in_microseconds)
+{
+	int res = 0;
+
+	pthread_mutex_t* child_lock = get_glock_internal_lock(child_p);
+	pthread_mutex_t* parent_lock = get_glock_internal_lock(parent_p);
+
+	// take both the internal locks, in the order of their addresses, so that the concurrent couplings (in any direction) can not deadlock
+	if(child_lock != NULL && parent_lock != NULL && parent_lock < child_lock)
+	{
+		lock_glock_lock(parent_p);
+		lock_glock_lock(child_p);
+	}
+	else
+	{
+		if(child_lock != NULL)
+			lock_glock_lock(child_p);
+		if(parent_lock != NULL)
+			lock_glock_lock(parent_p);
+	}
+
+	// with both of them held, lock the child and release the parent together, if the child is available
+	res = glock_lock_UNSAFE(child_p, child_lock_mode, NON_BLOCKING);
+	if(res || release_parent_before_blocking)
+		glock_unlock_UNSAFE(parent_p, parent_lock_mode);
+
+	// we must not be holding the parent's internal lock, while we block for the child
+	if(parent_lock != NULL)
+		pthread_mutex_unlock(parent_lock);
+
+	int parent_to_be_released = 0;
+	if(!res && timeout_in_microseconds != NON_BLOCKING)
+	{
+		res = glock_lock_UNSAFE(child_p, child_lock_mode, timeout_in_microseconds);
+		parent_to_be_released = res && !release_parent_before_blocking;
+	}
+
+	// the child got locked after blocking, and we are still holding the parent, so release it now
+	// it needs the parent's internal lock, which can be taken only without blocking, while we still hold the child's internal lock
+	if(parent_to_be_released && parent_lock != NULL && trylock_glock_lock(parent_p))
+	{
+		glock_unlock_UNSAFE(parent_p, parent_lock_mode);
+		pthread_mutex_unlock(parent_lock);
+		parent_to_be_released = 0;
+	}
+
+	if(child_lock != NULL)
+		pthread_mutex_unlock(child_lock);
+
+	// fallback, release the parent, after releasing the child's internal lock
+	if(parent_to_be_released)
+	{
+		if(parent_lock != NULL)
+			lock_glock_lock(parent_p);
+		glock_unlock_UNSAFE(parent_p, parent_lock_mode);
+		if(parent_lock != NULL)
+			pthread_mutex_unlock(parent_lock);
+	}
+
+	return res;
+}
+
 int is_glock_locked(glock* glock_p)
 {
 	if(glock_p->has_internal_lock)
-		pthread_mutex_lock(get_glock_lock(glock_p));
+		lock_glock_lock(glock_p);
 
 	int res = 0;
 	for(uint64_t i = 0; i < glock_p->gmatr->lock_modes_count && res == 0; i++) // if anyone has it locked, it is locked
@@ -229,7 +565,7 @@ int is_glock_locked(glock* glock_p)
 int has_glock_waiters(glock* glock_p)
 {
 	if(glock_p->has_internal_lock)
-		pthread_mutex_lock(get_glock_lock(glock_p));
+		lock_glock_lock(glock_p);
 
 	int res = (glock_p->waiters_count > 0); // check for any waiters
 
@@ -242,7 +578,7 @@ int has_glock_waiters(glock* glock_p)
 int is_glock_referenced(glock* glock_p)
 {
 	if(glock_p->has_internal_lock)
-		pthread_mutex_lock(get_glock_lock(glock_p));
+		lock_glock_lock(glock_p);
 
 	int res = (glock_p->waiters_count > 0); // check for any waiters
 	for(uint64_t i = 0; i < glock_p->gmatr->lock_modes_count && res == 0; i++) // or any one holding the lock
@@ -0,0 +1,93 @@
+#ifndef PROCESS_SHARED_UTILS_H
+#define PROCESS_SHARED_UTILS_H
+
+/*
+	internal header, used by the implementations of the process shared rwlock and glock
+	it is not installed as a public api header
+*/
+
+#include<pthread.h>
+#include<stdint.h>
+#include<limits.h>
+#include<time.h>
+#include<signal.h>
+#include<errno.h>
+#include<unistd.h>
+#include<sys/types.h>
+#include<sys/syscall.h>
+#include<linux/futex.h>
+
+#include<posixutils/pthread_cond_utils.h> // using NON_BLOCKING and BLOCKING
+
+// a robust mutex is granted with EOWNERDEAD, to the next thread locking it, after a process dies while holding it
+static inline void pthread_mutex_init_process_shared_robust(pthread_mutex_t* mutex_p)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(mutex_p, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+/*
+	a process shared pthread_cond_t can not be used, if a process may die while waiting on it
+	the dead waiter is never accounted as woken, so the next pthread_cond_signal or pthread_cond_broadcast on it blocks forever
+	so the process shared locks wait on a futex word instead (it is placed in the storage of the pthread_cond_t of the lock)
+	the word is incremented on every wake up, and waking up never waits for the waiters, dead or alive
+	it is 0 initialized and needs no destruction
+*/
+
+static inline void wake_up_process_shared_waiters(uint32_t* futex_p, int wake_up_all)
+{
+	__atomic_add_fetch(futex_p, 1, __ATOMIC_RELAXED);
+	syscall(SYS_futex, futex_p, FUTEX_WAKE, (wake_up_all ? INT_MAX : 1), NULL, NULL, 0);
+}
+
+// same semantics as pthread_cond_timedwait_for_microseconds (of PosixUtils), the futex_p must only be woken up with the mutex_p held
+static inline int process_shared_timedwait_for_microseconds(uint32_t* futex_p, pthread_mutex_t* mutex_p, uint64_t* timeout_in_microseconds)
+{
+	if((*timeout_in_microseconds) == NON_BLOCKING)
+		return ETIMEDOUT;
+
+	// any wake up after this point changes the futex word, and so will not be missed after releasing the mutex
+	uint32_t futex_value = __atomic_load_n(futex_p, __ATOMIC_RELAXED);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_mutex_unlock(mutex_p);
+
+	int wait_error = 0;
+	if((*timeout_in_microseconds) == BLOCKING)
+		syscall(SYS_futex, futex_p, FUTEX_WAIT, futex_value, NULL, NULL, 0);
+	else
+	{
+		struct timespec timeout = {.tv_sec = (*timeout_in_microseconds) / 1000000, .tv_nsec = ((*timeout_in_microseconds) % 1000000) * 1000};
+		if(syscall(SYS_futex, futex_p, FUTEX_WAIT, futex_value, &timeout, NULL, 0) == -1 && errno == ETIMEDOUT)
+			wait_error = ETIMEDOUT;
+	}
+
+	int lock_error = pthread_mutex_lock(mutex_p);
+
+	if((*timeout_in_microseconds) != BLOCKING)
+	{
+		struct timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		uint64_t elapsed_in_microseconds = (uint64_t)(((int64_t)(end.tv_sec - start.tv_sec) * 1000000) + ((end.tv_nsec - start.tv_nsec) / 1000));
+		(*timeout_in_microseconds) = (elapsed_in_microseconds >= (*timeout_in_microseconds)) ? NON_BLOCKING : ((*timeout_in_microseconds) - elapsed_in_microseconds);
+	}
+
+	// the mutex being recovered takes precedence over the timeout, as the caller must then make it consistent
+	if(lock_error == EOWNERDEAD)
+		return EOWNERDEAD;
+	return wait_error;
+}
+
+// a process that has exited, but has not yet been reaped by its parent (a zombie), is still considered alive
+static inline int is_process_alive(pid_t pid)
+{
+	return (kill(pid, 0) == 0) || (errno != ESRCH);
+}
+
+#endif
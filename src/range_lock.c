@@ -0,0 +1,416 @@
+#include<lockking/range_lock.h>
+
+#include<cutlery/cutlery_math.h> // using max() macro
+
+static inline pthread_mutex_t* get_range_lock_lock(range_lock* range_lock_p)
+{
+	if(range_lock_p->has_internal_lock)
+		return &(range_lock_p->internal_lock);
+	else
+		return range_lock_p->external_lock;
+}
+
+void initialize_range_lock(range_lock* range_lock_p, pthread_mutex_t* external_lock)
+{
+	if(external_lock)
+	{
+		range_lock_p->has_internal_lock = 0;
+		range_lock_p->external_lock = external_lock;
+	}
+	else
+	{
+		range_lock_p->has_internal_lock = 1;
+		pthread_mutex_init(&(range_lock_p->internal_lock), NULL);
+	}
+
+	range_lock_p->read_locked = NULL;
+	range_lock_p->write_locked = NULL;
+	range_lock_p->read_waiting = NULL;
+	range_lock_p->write_waiting = NULL;
+
+	range_lock_p->priority_seed = UINT64_C(0x9E3779B97F4A7C15);
+}
+
+void deinitialize_range_lock(range_lock* range_lock_p)
+{
+	if(range_lock_p->has_internal_lock)
+		pthread_mutex_destroy(&(range_lock_p->internal_lock));
+}
+
+//-----------------------------------------------------------------------------
+//------------- interval tree (augmented treap) over the requests -------------
+//-----------------------------------------------------------------------------
+
+// xorshift64, to generate the treap priorities
+static inline uint64_t get_next_priority(range_lock* range_lock_p)
+{
+	uint64_t x = range_lock_p->priority_seed;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	range_lock_p->priority_seed = x;
+	return x;
+}
+
+// orders nodes by their start, ties are broken by their addresses, so that no two nodes ever compare equal
+static inline int compare_requests(const range_lock_request* a, const range_lock_request* b)
+{
+	if(a->start != b->start)
+		return (a->start < b->start) ? -1 : 1;
+	if(a != b)
+		return (a < b) ? -1 : 1;
+	return 0;
+}
+
+static inline void recompute_max_end(range_lock_request* node)
+{
+	node->max_end = node->end;
+	if(node->left != NULL)
+		node->max_end = max(node->max_end, node->left->max_end);
+	if(node->right != NULL)
+		node->max_end = max(node->max_end, node->right->max_end);
+}
+
+static inline int are_ranges_overlapping(uint64_t start1, uint64_t end1, uint64_t start2, uint64_t end2)
+{
+	return (start1 < end2) && (start2 < end1);
+}
+
+// splits the tree at root into 2 trees, *l with all nodes lesser than key and *r with all the rest
+static void split_tree(range_lock_request* root, const range_lock_request* key, range_lock_request** l, range_lock_request** r)
+{
+	if(root == NULL)
+	{
+		(*l) = NULL;
+		(*r) = NULL;
+		return;
+	}
+
+	if(compare_requests(root, key) < 0)
+	{
+		split_tree(root->right, key, &(root->right), r);
+		(*l) = root;
+	}
+	else
+	{
+		split_tree(root->left, key, l, &(root->left));
+		(*r) = root;
+	}
+	recompute_max_end(root);
+}
+
+// merges 2 trees, all nodes of l must be lesser than all nodes of r
+static range_lock_request* merge_trees(range_lock_request* l, range_lock_request* r)
+{
+	if(l == NULL)
+		return r;
+	if(r == NULL)
+		return l;
+
+	if(l->priority > r->priority)
+	{
+		l->right = merge_trees(l->right, r);
+		recompute_max_end(l);
+		return l;
+	}
+	else
+	{
+		r->left = merge_trees(l, r->left);
+		recompute_max_end(r);
+		return r;
+	}
+}
+
+static void insert_in_tree(range_lock_request** root, range_lock_request* node)
+{
+	if((*root) == NULL || node->priority > (*root)->priority)
+	{
+		split_tree((*root), node, &(node->left), &(node->right));
+		recompute_max_end(node);
+		(*root) = node;
+		return;
+	}
+
+	if(compare_requests(node, (*root)) < 0)
+		insert_in_tree(&((*root)->left), node);
+	else
+		insert_in_tree(&((*root)->right), node);
+	recompute_max_end((*root));
+}
+
+// returns 1, only if the node was found in the tree and removed from it
+static int remove_from_tree(range_lock_request** root, range_lock_request* node)
+{
+	if((*root) == NULL)
+		return 0;
+
+	int cmp = compare_requests(node, (*root));
+	if(cmp == 0)
+	{
+		(*root) = merge_trees(node->left, node->right);
+		node->left = NULL;
+		node->right = NULL;
+		return 1;
+	}
+
+	int removed = remove_from_tree((cmp < 0) ? &((*root)->left) : &((*root)->right), node);
+	if(removed)
+		recompute_max_end((*root));
+	return removed;
+}
+
+// returns 1, if any of the ranges in the tree overlap with [start, end)
+static int has_overlap_in_tree(const range_lock_request* root, uint64_t start, uint64_t end)
+{
+	while(root != NULL)
+	{
+		if(are_ranges_overlapping(root->start, root->end, start, end))
+			return 1;
+
+		// if some range in the left subtree ends after start, then either it overlaps
+		// or it starts at or after end, and then so does every range to the right of it
+		if(root->left != NULL && root->left->max_end > start)
+			root = root->left;
+		else
+			root = root->right;
+	}
+	return 0;
+}
+
+// signals the condition variables of all the waiters in the tree, that overlap with [start, end)
+static void wake_up_overlapping_in_tree(range_lock_request* root, uint64_t start, uint64_t end)
+{
+	// no range in this subtree ends after start
+	if(root == NULL || root->max_end <= start)
+		return;
+
+	wake_up_overlapping_in_tree(root->left, start, end);
+
+	// this node and all the nodes to its right start at or after end
+	if(root->start >= end)
+		return;
+
+	if(are_ranges_overlapping(root->start, root->end, start, end))
+		pthread_cond_signal(&(root->wait));
+
+	wake_up_overlapping_in_tree(root->right, start, end);
+}
+
+static inline void initialize_request(range_lock* range_lock_p, range_lock_request* request_p, uint64_t start, uint64_t end)
+{
+	request_p->start = start;
+	request_p->end = end;
+	request_p->left = NULL;
+	request_p->right = NULL;
+	request_p->priority = get_next_priority(range_lock_p);
+	request_p->max_end = end;
+}
+
+//-----------------------------------------------------------------------------
+//------------- RANGE_LOCK - the lock itself is implemented below -------------
+//-----------------------------------------------------------------------------
+
+static inline int can_grab_range_read_lock(const range_lock* range_lock_p, const range_lock_request* request_p, lock_preferring_type preferring)
+{
+	// in read preferring mode, you grab lock immediately when you see that no writers hold an overlapping lock
+	if(has_overlap_in_tree(range_lock_p->write_locked, request_p->start, request_p->end))
+		return 0;
+
+	// while in write preferring (or adaptive) mode, you also wait for all the overlapping writers waiting to hold the lock
+	if(preferring != READ_PREFERRING && has_overlap_in_tree(range_lock_p->write_waiting, request_p->start, request_p->end))
+		return 0;
+
+	return 1;
+}
+
+int range_read_lock(range_lock* range_lock_p, range_lock_request* request_p, uint64_t start, uint64_t end, lock_preferring_type preferring, uint64_t timeout_in_microseconds)
+{
+	// can not lock an empty range
+	if(start >= end)
+		return 0;
+
+	int res = 0;
+
+	if(range_lock_p->has_internal_lock)
+		pthread_mutex_lock(get_range_lock_lock(range_lock_p));
+
+	initialize_request(range_lock_p, request_p, start, end);
+
+	if(timeout_in_microseconds != NON_BLOCKING && !can_grab_range_read_lock(range_lock_p, request_p, preferring)) // you are allowed to block only if (timeout_in_microseconds != NON_BLOCKING)
+	{
+		pthread_cond_init_with_monotonic_clock(&(request_p->wait));
+		insert_in_tree(&(range_lock_p->read_waiting), request_p);
+
+		int wait_error = 0;
+		while(!can_grab_range_read_lock(range_lock_p, request_p, preferring) && !wait_error) // block while you can not grab lock and there is no wait error
+			wait_error = pthread_cond_timedwait_for_microseconds(&(request_p->wait), get_range_lock_lock(range_lock_p), &timeout_in_microseconds);
+
+		remove_from_tree(&(range_lock_p->read_waiting), request_p);
+		pthread_cond_destroy(&(request_p->wait));
+	}
+
+	// if you can grab a lock, then grab it, else fail
+	if(can_grab_range_read_lock(range_lock_p, request_p, preferring))
+	{
+		insert_in_tree(&(range_lock_p->read_locked), request_p);
+		res = 1;
+	}
+
+	if(range_lock_p->has_internal_lock)
+		pthread_mutex_unlock(get_range_lock_lock(range_lock_p));
+
+	return res;
+}
+
+static inline int can_grab_range_write_lock(const range_lock* range_lock_p, const range_lock_request* request_p)
+{
+	// a write lock can only be grabbed if there are no active readers and writers over any overlapping range
+	return !has_overlap_in_tree(range_lock_p->read_locked, request_p->start, request_p->end)
+		&& !has_overlap_in_tree(range_lock_p->write_locked, request_p->start, request_p->end);
+}
+
+int range_write_lock(range_lock* range_lock_p, range_lock_request* request_p, uint64_t start, uint64_t end, uint64_t timeout_in_microseconds)
+{
+	// can not lock an empty range
+	if(start >= end)
+		return 0;
+
+	int res = 0;
+	int was_blocked = 0;
+
+	if(range_lock_p->has_internal_lock)
+		pthread_mutex_lock(get_range_lock_lock(range_lock_p));
+
+	initialize_request(range_lock_p, request_p, start, end);
+
+	if(timeout_in_microseconds != NON_BLOCKING && !can_grab_range_write_lock(range_lock_p, request_p)) // you can block only if timeout_in_microsecond != NON_BLOCKING
+	{
+		pthread_cond_init_with_monotonic_clock(&(request_p->wait));
+		insert_in_tree(&(range_lock_p->write_waiting), request_p);
+
+		int wait_error = 0;
+		while(!can_grab_range_write_lock(range_lock_p, request_p) && !wait_error) // block while you can not grab lock and there is no wait error
+			wait_error = pthread_cond_timedwait_for_microseconds(&(request_p->wait), get_range_lock_lock(range_lock_p), &timeout_in_microseconds);
+		was_blocked = 1;
+
+		remove_from_tree(&(range_lock_p->write_waiting), request_p);
+		pthread_cond_destroy(&(request_p->wait));
+	}
+
+	if(can_grab_range_write_lock(range_lock_p, request_p))
+	{
+		insert_in_tree(&(range_lock_p->write_locked), request_p);
+		res = 1;
+	}
+	else
+	{
+		if(was_blocked) // while we were blocked some overlapping write preferring readers could have gone to wait, so we just wake them up
+			wake_up_overlapping_in_tree(range_lock_p->read_waiting, start, end);
+	}
+
+	if(range_lock_p->has_internal_lock)
+		pthread_mutex_unlock(get_range_lock_lock(range_lock_p));
+
+	return res;
+}
+
+int range_read_unlock(range_lock* range_lock_p, range_lock_request* request_p)
+{
+	int res = 0;
+
+	if(range_lock_p->has_internal_lock)
+		pthread_mutex_lock(get_range_lock_lock(range_lock_p));
+
+	// make sure that the request is holding a read lock, and release it
+	if(!remove_from_tree(&(range_lock_p->read_locked), request_p))
+		goto EXIT;
+	res = 1;
+
+	// readers never wait for other readers, so wake up only the overlapping writers
+	wake_up_overlapping_in_tree(range_lock_p->write_waiting, request_p->start, request_p->end);
+
+	EXIT:;
+	if(range_lock_p->has_internal_lock)
+		pthread_mutex_unlock(get_range_lock_lock(range_lock_p));
+
+	return res;
+}
+
+int range_write_unlock(range_lock* range_lock_p, range_lock_request* request_p)
+{
+	int res = 0;
+
+	if(range_lock_p->has_internal_lock)
+		pthread_mutex_lock(get_range_lock_lock(range_lock_p));
+
+	// make sure that the request is holding a write lock, and release it
+	if(!remove_from_tree(&(range_lock_p->write_locked), request_p))
+		goto EXIT;
+	res = 1;
+
+	// wake up all the overlapping waiters, they will recheck for their own range
+	wake_up_overlapping_in_tree(range_lock_p->write_waiting, request_p->start, request_p->end);
+	wake_up_overlapping_in_tree(range_lock_p->read_waiting, request_p->start, request_p->end);
+
+	EXIT:;
+	if(range_lock_p->has_internal_lock)
+		pthread_mutex_unlock(get_range_lock_lock(range_lock_p));
+
+	return res;
+}
+
+int is_range_read_locked(range_lock* range_lock_p, uint64_t start, uint64_t end)
+{
+	if(range_lock_p->has_internal_lock)
+		pthread_mutex_lock(get_range_lock_lock(range_lock_p));
+
+	int res = has_overlap_in_tree(range_lock_p->read_locked, start, end);
+
+	if(range_lock_p->has_internal_lock)
+		pthread_mutex_unlock(get_range_lock_lock(range_lock_p));
+
+	return res;
+}
+
+int is_range_write_locked(range_lock* range_lock_p, uint64_t start, uint64_t end)
+{
+	if(range_lock_p->has_internal_lock)
+		pthread_mutex_lock(get_range_lock_lock(range_lock_p));
+
+	int res = has_overlap_in_tree(range_lock_p->write_locked, start, end);
+
+	if(range_lock_p->has_internal_lock)
+		pthread_mutex_unlock(get_range_lock_lock(range_lock_p));
+
+	return res;
+}
+
+int has_range_lock_waiters(range_lock* range_lock_p)
+{
+	if(range_lock_p->has_internal_lock)
+		pthread_mutex_lock(get_range_lock_lock(range_lock_p));
+
+	int res = (range_lock_p->read_waiting != NULL) ||
+				(range_lock_p->write_waiting != NULL);
+
+	if(range_lock_p->has_internal_lock)
+		pthread_mutex_unlock(get_range_lock_lock(range_lock_p));
+
+	return res;
+}
+
+int is_range_lock_referenced(range_lock* range_lock_p)
+{
+	if(range_lock_p->has_internal_lock)
+		pthread_mutex_lock(get_range_lock_lock(range_lock_p));
+
+	int res = (range_lock_p->read_locked != NULL) ||
+				(range_lock_p->write_locked != NULL) ||
+				(range_lock_p->read_waiting != NULL) ||
+				(range_lock_p->write_waiting != NULL);
+
+	if(range_lock_p->has_internal_lock)
+		pthread_mutex_unlock(get_range_lock_lock(range_lock_p));
+
+	return res;
+}
@@ -1,5 +1,14 @@
 #include<lockking/rwlock.h>
 
+#include<errno.h>
+#include<string.h>
+#include<time.h>
+#include<unistd.h>
+
+#include<cutlery/cutlery_math.h> // using min() and max() macros
+
+#include"process_shared_utils.h"
+
 static inline pthread_mutex_t* get_rwlock_lock(rwlock* rwlock_p)
 {
 	if(rwlock_p->has_internal_lock)
@@ -8,6 +17,220 @@ static inline pthread_mutex_t* get_rwlock_lock(rwlock* rwlock_p)
 		return rwlock_p->external_lock;
 }
 
+// the below counts of a process shared rwlock are also accounted in the rwlock_process_state of the calling process
+// process_state_p is NULL for an rwlock that is not process shared
+#define INCREMENT_COUNT(rwlock_p, process_state_p, count) do{ (rwlock_p)->count++; if((process_state_p) != NULL) (process_state_p)->count++; }while(0)
+#define DECREMENT_COUNT(rwlock_p, process_state_p, count) do{ (rwlock_p)->count--; if((process_state_p) != NULL) (process_state_p)->count--; }while(0)
+
+// must be called every time a writer releases its lock (by unlocking or downgrading it)
+// all the PHASE_FAIR readers waiting at this point are entitled to the read phase that begins now
+static inline void end_write_phase(rwlock* rwlock_p)
+{
+	rwlock_p->write_phases_count++;
+	rwlock_p->phase_fair_readers_entitled_count = rwlock_p->phase_fair_readers_waiting_count;
+	if(rwlock_p->is_process_shared)
+	{
+		for(uint64_t i = 0; i < rwlock_p->process_states_count; i++)
+			rwlock_p->process_states[i].phase_fair_readers_entitled_count = rwlock_p->process_states[i].phase_fair_readers_waiting_count;
+	}
+}
+
+// a process shared rwlock waits on the futex words placed in its condition variables, see process_shared_utils.h
+
+static inline void signal_rwlock_waiter(rwlock* rwlock_p, pthread_cond_t* wait)
+{
+	if(rwlock_p->is_process_shared)
+		wake_up_process_shared_waiters((uint32_t*)wait, 0);
+	else
+		pthread_cond_signal(wait);
+}
+
+static inline void broadcast_rwlock_waiters(rwlock* rwlock_p, pthread_cond_t* wait)
+{
+	if(rwlock_p->is_process_shared)
+		wake_up_process_shared_waiters((uint32_t*)wait, 1);
+	else
+		pthread_cond_broadcast(wait);
+}
+
+static uint64_t recover_dead_processes(rwlock* rwlock_p)
+{
+	uint64_t recovered_count = 0;
+	for(uint64_t i = 0; i < rwlock_p->process_states_count; i++)
+	{
+		rwlock_process_state* process_state_p = &(rwlock_p->process_states[i]);
+		if(process_state_p->pid != 0 && !is_process_alive(process_state_p->pid))
+		{
+			memset(process_state_p, 0, sizeof(rwlock_process_state));
+			recovered_count++;
+		}
+	}
+
+	if(recovered_count == 0)
+		return 0;
+
+	// the counts of the rwlock are the sums of the counts of the live processes
+	// this also undoes a partial update, by a process that died while holding the rwlock's mutex
+	uint64_t readers_count = 0;
+	uint64_t writers_count = 0;
+	uint64_t upgraders_waiting_count = 0;
+	uint64_t readers_waiting_count = 0;
+	uint64_t writers_waiting_count = 0;
+	uint64_t adaptive_readers_waiting_count = 0;
+	uint64_t phase_fair_readers_waiting_count = 0;
+	for(uint64_t i = 0; i < rwlock_p->process_states_count; i++)
+	{
+		const rwlock_process_state* process_state_p = &(rwlock_p->process_states[i]);
+		readers_count += process_state_p->readers_count;
+		writers_count += process_state_p->writers_count;
+		upgraders_waiting_count += process_state_p->upgraders_waiting_count;
+		readers_waiting_count += process_state_p->readers_waiting_count;
+		writers_waiting_count += process_state_p->writers_waiting_count;
+		adaptive_readers_waiting_count += process_state_p->adaptive_readers_waiting_count;
+		phase_fair_readers_waiting_count += process_state_p->phase_fair_readers_waiting_count;
+	}
+	rwlock_p->readers_count = readers_count;
+	rwlock_p->writers_count = (writers_count > 0);
+	rwlock_p->upgraders_waiting_count = (upgraders_waiting_count > 0);
+	rwlock_p->readers_waiting_count = readers_waiting_count;
+	rwlock_p->writers_waiting_count = writers_waiting_count;
+	rwlock_p->adaptive_readers_waiting_count = adaptive_readers_waiting_count;
+	rwlock_p->phase_fair_readers_waiting_count = phase_fair_readers_waiting_count;
+
+	// the dead process may have been ending a write phase, so end it again, it entitles all the PHASE_FAIR readers waiting now
+	end_write_phase(rwlock_p);
+
+	// wake up everyone, to recheck the lock state without the dead processes
+	broadcast_rwlock_waiters(rwlock_p, &(rwlock_p->read_wait));
+	broadcast_rwlock_waiters(rwlock_p, &(rwlock_p->adaptive_read_wait));
+	broadcast_rwlock_waiters(rwlock_p, &(rwlock_p->write_wait));
+	broadcast_rwlock_waiters(rwlock_p, &(rwlock_p->upgrade_wait));
+
+	return recovered_count;
+}
+
+// if a process dies while holding the robust mutex of a process shared rwlock, the mutex is granted to the next locker with EOWNERDEAD
+// then the state of the dead process is rolled back, before making the mutex consistent
+// use it only for the internal lock, an external_lock made consistent here would hide the dead owner from the caller, that must recover all the locks using it
+static inline void lock_rwlock_lock(rwlock* rwlock_p)
+{
+	if(pthread_mutex_lock(get_rwlock_lock(rwlock_p)) == EOWNERDEAD)
+	{
+		recover_dead_processes(rwlock_p);
+		pthread_mutex_consistent(get_rwlock_lock(rwlock_p));
+	}
+}
+
+// the same as lock_rwlock_lock, but it does not block, it returns 1 only if the internal lock was taken
+static inline int trylock_rwlock_lock(rwlock* rwlock_p)
+{
+	int lock_error = pthread_mutex_trylock(get_rwlock_lock(rwlock_p));
+	if(lock_error == EOWNERDEAD)
+	{
+		recover_dead_processes(rwlock_p);
+		pthread_mutex_consistent(get_rwlock_lock(rwlock_p));
+		return 1;
+	}
+	return lock_error == 0;
+}
+
+static inline int timedwait_on_rwlock(rwlock* rwlock_p, pthread_cond_t* wait, uint64_t* timeout_in_microseconds)
+{
+	int wait_error;
+	if(rwlock_p->is_process_shared)
+		wait_error = process_shared_timedwait_for_microseconds((uint32_t*)wait, get_rwlock_lock(rwlock_p), timeout_in_microseconds);
+	else
+		wait_error = pthread_cond_timedwait_for_microseconds(wait, get_rwlock_lock(rwlock_p), timeout_in_microseconds);
+	if(wait_error == EOWNERDEAD)
+	{
+		if(rwlock_p->has_internal_lock)
+		{
+			recover_dead_processes(rwlock_p);
+			pthread_mutex_consistent(get_rwlock_lock(rwlock_p));
+			wait_error = 0;
+		}
+		else // the external_lock is left inconsistent, the call fails and the caller must recover it
+			errno = EOWNERDEAD;
+	}
+	return wait_error;
+}
+
+// relocks the external_lock, that the caller must be holding when the call returns
+// it returns 0 if it was held by a dead owner, then errno is set and it is left inconsistent, for the caller to recover it
+static inline int relock_external_lock(rwlock* rwlock_p)
+{
+	if(pthread_mutex_lock(get_rwlock_lock(rwlock_p)) == EOWNERDEAD)
+	{
+		errno = EOWNERDEAD;
+		return 0;
+	}
+	return 1;
+}
+
+// returns the slot of the calling process, claiming a new one if necessary, it returns NULL only if all the slots are in use
+static rwlock_process_state* get_process_state(rwlock* rwlock_p)
+{
+	pid_t pid = getpid();
+
+	rwlock_process_state* unused_process_state_p = NULL;
+	for(uint64_t i = 0; i < rwlock_p->process_states_count; i++)
+	{
+		if(rwlock_p->process_states[i].pid == pid)
+			return &(rwlock_p->process_states[i]);
+		if(unused_process_state_p == NULL && rwlock_p->process_states[i].pid == 0)
+			unused_process_state_p = &(rwlock_p->process_states[i]);
+	}
+
+	// all slots are in use, try to free the slots of the dead processes
+	if(unused_process_state_p == NULL && recover_dead_processes(rwlock_p) > 0)
+	{
+		for(uint64_t i = 0; i < rwlock_p->process_states_count && unused_process_state_p == NULL; i++)
+		{
+			if(rwlock_p->process_states[i].pid == 0)
+				unused_process_state_p = &(rwlock_p->process_states[i]);
+		}
+	}
+
+	if(unused_process_state_p != NULL)
+		unused_process_state_p->pid = pid;
+	return unused_process_state_p;
+}
+
+// releases the slot of the calling process, if it neither holds nor waits for the rwlock
+static inline void put_process_state(rwlock_process_state* process_state_p)
+{
+	if(process_state_p == NULL)
+		return;
+	if(process_state_p->readers_count == 0 && process_state_p->writers_count == 0 &&
+		process_state_p->upgraders_waiting_count == 0 && process_state_p->readers_waiting_count == 0 &&
+		process_state_p->writers_waiting_count == 0 && process_state_p->adaptive_readers_waiting_count == 0 &&
+		process_state_p->phase_fair_readers_waiting_count == 0 &&
+		process_state_p->phase_fair_readers_entitled_count == 0)
+		process_state_p->pid = 0;
+}
+
+// acquires the slot of the calling process for a process shared rwlock, it fails only if all the slots are in use
+#define ACQUIRE_PROCESS_STATE(rwlock_p, process_state_p) ((!(rwlock_p)->is_process_shared) || (((process_state_p) = get_process_state(rwlock_p)) != NULL))
+
+static void initialize_rwlock_attributes(rwlock* rwlock_p)
+{
+	rwlock_p->readers_count = 0;
+	rwlock_p->writers_count = 0;
+	rwlock_p->upgraders_waiting_count = 0;
+	rwlock_p->readers_waiting_count = 0;
+	rwlock_p->writers_waiting_count = 0;
+	rwlock_p->adaptive_readers_waiting_count = 0;
+	rwlock_p->readers_bypassing_writers_count = 0;
+	rwlock_p->writers_waiting_since = 0;
+	rwlock_p->read_arrivals_count = 0;
+	rwlock_p->readers_per_writer = 0;
+	rwlock_p->write_phases_count = 0;
+	rwlock_p->phase_fair_readers_waiting_count = 0;
+	rwlock_p->phase_fair_readers_entitled_count = 0;
+	rwlock_p->closures_head = NULL;
+	rwlock_p->closures_tail = NULL;
+}
+
 void initialize_rwlock(rwlock* rwlock_p, pthread_mutex_t* external_lock)
 {
 	if(external_lock)
@@ -21,59 +244,253 @@ void initialize_rwlock(rwlock* rwlock_p, pthread_mutex_t* external_lock)
 		pthread_mutex_init(&(rwlock_p->internal_lock), NULL);
 	}
 
-	rwlock_p->readers_count = 0;
-	rwlock_p->writers_count = 0;
-	rwlock_p->upgraders_waiting_count = 0;
-	rwlock_p->readers_waiting_count = 0;
-	rwlock_p->writers_waiting_count = 0;
+	rwlock_p->is_process_shared = 0;
+	rwlock_p->process_states = NULL;
+	rwlock_p->process_states_count = 0;
+
+	initialize_rwlock_attributes(rwlock_p);
 
 	pthread_cond_init_with_monotonic_clock(&(rwlock_p->read_wait));
+	pthread_cond_init_with_monotonic_clock(&(rwlock_p->adaptive_read_wait));
 	pthread_cond_init_with_monotonic_clock(&(rwlock_p->write_wait));
 	pthread_cond_init_with_monotonic_clock(&(rwlock_p->upgrade_wait));
 }
 
+int initialize_process_shared_rwlock(rwlock* rwlock_p, pthread_mutex_t* external_lock, rwlock_process_state* process_states, uint64_t process_states_count)
+{
+	if(process_states == NULL || process_states_count == 0)
+		return 0;
+
+	if(external_lock)
+	{
+		rwlock_p->has_internal_lock = 0;
+		rwlock_p->external_lock = external_lock;
+	}
+	else
+	{
+		rwlock_p->has_internal_lock = 1;
+		pthread_mutex_init_process_shared_robust(&(rwlock_p->internal_lock));
+	}
+
+	rwlock_p->is_process_shared = 1;
+	rwlock_p->process_states = process_states;
+	rwlock_p->process_states_count = process_states_count;
+	memset(process_states, 0, sizeof(rwlock_process_state) * process_states_count);
+
+	initialize_rwlock_attributes(rwlock_p);
+
+	// the condition variables are used as futex words
+	memset(&(rwlock_p->read_wait), 0, sizeof(pthread_cond_t));
+	memset(&(rwlock_p->adaptive_read_wait), 0, sizeof(pthread_cond_t));
+	memset(&(rwlock_p->write_wait), 0, sizeof(pthread_cond_t));
+	memset(&(rwlock_p->upgrade_wait), 0, sizeof(pthread_cond_t));
+
+	return 1;
+}
+
+uint64_t recover_process_shared_rwlock(rwlock* rwlock_p)
+{
+	if(!rwlock_p->is_process_shared)
+		return 0;
+
+	if(rwlock_p->has_internal_lock)
+		lock_rwlock_lock(rwlock_p);
+
+	uint64_t res = recover_dead_processes(rwlock_p);
+
+	if(rwlock_p->has_internal_lock)
+		pthread_mutex_unlock(get_rwlock_lock(rwlock_p));
+
+	return res;
+}
+
 void deinitialize_rwlock(rwlock* rwlock_p)
 {
 	if(rwlock_p->has_internal_lock)
 		pthread_mutex_destroy(&(rwlock_p->internal_lock));
-	pthread_cond_destroy(&(rwlock_p->read_wait));
-	pthread_cond_destroy(&(rwlock_p->write_wait));
-	pthread_cond_destroy(&(rwlock_p->upgrade_wait));
+	if(!rwlock_p->is_process_shared)
+	{
+		pthread_cond_destroy(&(rwlock_p->read_wait));
+		pthread_cond_destroy(&(rwlock_p->adaptive_read_wait));
+		pthread_cond_destroy(&(rwlock_p->write_wait));
+		pthread_cond_destroy(&(rwlock_p->upgrade_wait));
+	}
+}
+
+static inline int are_writers_waiting(const rwlock* rwlock_p)
+{
+	return (rwlock_p->writers_waiting_count > 0) || (rwlock_p->upgraders_waiting_count > 0);
+}
+
+// the threads waiting in execute_with_write_lock are also counted as waiting writers, but they wait on the condition variable of their own closure
+// so along with a writer, we also wake up the thread of the first unexecuted closure, one of them will get the lock and the other will go back to waiting
+static inline void wake_up_writer(rwlock* rwlock_p)
+{
+	if(rwlock_p->closures_head != NULL)
+		pthread_cond_signal(&(rwlock_p->closures_head->wait));
+	signal_rwlock_waiter(rwlock_p, &(rwlock_p->write_wait));
+}
+
+// the ADAPTIVE_PREFERRING readers wait on their own condition variable, so that they alone can be woken up to bypass the waiting writers
+static inline void wake_up_readers(rwlock* rwlock_p)
+{
+	if(rwlock_p->readers_waiting_count > rwlock_p->adaptive_readers_waiting_count)
+		broadcast_rwlock_waiters(rwlock_p, &(rwlock_p->read_wait));
+	if(rwlock_p->adaptive_readers_waiting_count > 0)
+		broadcast_rwlock_waiters(rwlock_p, &(rwlock_p->adaptive_read_wait));
+}
+
+// readers_per_writer is kept in fixed point, scaled by this factor
+#define READERS_PER_WRITER_SCALE UINT64_C(16)
+
+static inline uint64_t get_monotonic_time_in_microseconds()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (((uint64_t)now.tv_sec) * UINT64_C(1000000)) + (((uint64_t)now.tv_nsec) / UINT64_C(1000));
+}
+
+// the number of ADAPTIVE_PREFERRING readers that may bypass the waiting writers, readers_per_writer rounded to the nearest integer
+static inline uint64_t get_adaptive_readers_bypass_limit(const rwlock* rwlock_p)
+{
+	return max(UINT64_C(1), min((rwlock_p->readers_per_writer + (READERS_PER_WRITER_SCALE / 2)) / READERS_PER_WRITER_SCALE, RWLOCK_ADAPTIVE_MAX_READERS_BYPASSING_WRITERS));
 }
 
-static inline int can_grab_read_lock(const rwlock* rwlock_p, lock_preferring_type preferring)
+// an ADAPTIVE_PREFERRING reader may bypass the waiting writers, only until the bypass limit is reached, and only until the writers have waited for too long
+static inline int can_adaptive_reader_bypass_writers(const rwlock* rwlock_p)
+{
+	if(rwlock_p->readers_bypassing_writers_count >= get_adaptive_readers_bypass_limit(rwlock_p))
+		return 0;
+	return (get_monotonic_time_in_microseconds() - rwlock_p->writers_waiting_since) < RWLOCK_ADAPTIVE_MAX_WRITERS_WAIT_IN_MICROSECONDS;
+}
+
+// must be called by a writer (or an upgrader) every time before it starts to wait, wait_start is the time it first started to wait (0 if it has not yet waited)
+// if no one else is waiting, then the writers have been waiting since this writer started to wait
+static inline void start_writer_wait(rwlock* rwlock_p, uint64_t* wait_start)
+{
+	if((*wait_start) == 0)
+		(*wait_start) = get_monotonic_time_in_microseconds();
+	if(!are_writers_waiting(rwlock_p))
+		rwlock_p->writers_waiting_since = (*wait_start);
+}
+
+// must be called every time a writer (or an upgrader) is granted the lock
+// it restarts the bypass limit for the ADAPTIVE_PREFERRING readers, and the rest of the waiting writers are now considered to be waiting since this moment
+static inline void grant_writer(rwlock* rwlock_p)
+{
+	rwlock_p->readers_bypassing_writers_count = 0;
+	if(are_writers_waiting(rwlock_p))
+		rwlock_p->writers_waiting_since = get_monotonic_time_in_microseconds();
+}
+
+// every read_lock and write_lock call is counted as an arrival (only once, even if it is retried internally), for the ADAPTIVE_PREFERRING readers
+static inline void count_arrival(rwlock* rwlock_p, rwlock_mode mode)
+{
+	if(mode == RWLOCK_READ_MODE)
+		rwlock_p->read_arrivals_count++;
+	else
+	{
+		// sample the number of readers that arrived since the last writer
+		rwlock_p->readers_per_writer = (rwlock_p->readers_per_writer * 3 + rwlock_p->read_arrivals_count * READERS_PER_WRITER_SCALE) / 4;
+		rwlock_p->read_arrivals_count = 0;
+	}
+}
+
+// wakes up the waiting ADAPTIVE_PREFERRING readers, if they can bypass the waiting writers
+static inline void wake_up_bypassing_adaptive_readers(rwlock* rwlock_p)
+{
+	if(rwlock_p->adaptive_readers_waiting_count > 0 && rwlock_p->writers_count == 0 && can_adaptive_reader_bypass_writers(rwlock_p))
+		broadcast_rwlock_waiters(rwlock_p, &(rwlock_p->adaptive_read_wait));
+}
+
+// a waiting PHASE_FAIR reader is entitled to the next read phase, if a write phase ended since it arrived
+static inline int is_phase_fair_reader_entitled(const rwlock* rwlock_p, uint64_t arrival_write_phase)
+{
+	return rwlock_p->write_phases_count != arrival_write_phase;
+}
+
+static inline int can_grab_read_lock(const rwlock* rwlock_p, lock_preferring_type preferring, uint64_t arrival_write_phase)
 {
 	if(preferring == READ_PREFERRING) // in read preferring mode, you grab lock immediately when you see that no writers hold lock
 		return (rwlock_p->writers_count == 0);
+	else if(preferring == PHASE_FAIR) // in phase fair mode, you bypass the waiting writers, only if you were waiting through the last write phase
+		return (rwlock_p->writers_count == 0) && (!are_writers_waiting(rwlock_p) || is_phase_fair_reader_entitled(rwlock_p, arrival_write_phase));
+	else if(preferring == ADAPTIVE_PREFERRING) // in adaptive mode, you may bypass the waiting writers, only until the bypass limit is reached
+		return (rwlock_p->writers_count == 0) && (!are_writers_waiting(rwlock_p) || can_adaptive_reader_bypass_writers(rwlock_p));
 	else // while in write preferring mode, it favors writers over readers, and waiting for all waiters trying to hold write lock to exit
-		return (rwlock_p->writers_count == 0) && (rwlock_p->writers_waiting_count == 0) && (rwlock_p->upgraders_waiting_count == 0);
+		return (rwlock_p->writers_count == 0) && !are_writers_waiting(rwlock_p);
 }
 
-int read_lock(rwlock* rwlock_p, lock_preferring_type preferring, uint64_t timeout_in_microseconds)
+// the *_UNSAFE functions must be called with the rwlock's mutex held, the public functions are their wrappers, that lock the internal lock if any
+
+static int read_lock_UNSAFE(rwlock* rwlock_p, lock_preferring_type preferring, uint64_t timeout_in_microseconds)
 {
 	int res = 0;
 
-	if(rwlock_p->has_internal_lock)
-		pthread_mutex_lock(get_rwlock_lock(rwlock_p));
+	rwlock_process_state* process_state_p = NULL;
+	if(!ACQUIRE_PROCESS_STATE(rwlock_p, process_state_p))
+		goto EXIT;
+
+	uint64_t arrival_write_phase = rwlock_p->write_phases_count;
 
+	int wait_error = 0;
 	if(timeout_in_microseconds != NON_BLOCKING) // you are allowed to block only if (timeout_in_microseconds != NON_BLOCKING)
 	{
-		int wait_error = 0;
-		while(!can_grab_read_lock(rwlock_p, preferring) && !wait_error) // block while you can not grab lock and there is no wait error
+		while(!can_grab_read_lock(rwlock_p, preferring, arrival_write_phase) && !wait_error) // block while you can not grab lock and there is no wait error
 		{
-			rwlock_p->readers_waiting_count++;
-			wait_error = pthread_cond_timedwait_for_microseconds(&(rwlock_p->read_wait), get_rwlock_lock(rwlock_p), &timeout_in_microseconds);
-			rwlock_p->readers_waiting_count--;
+			INCREMENT_COUNT(rwlock_p, process_state_p, readers_waiting_count);
+			if(preferring == PHASE_FAIR)
+				INCREMENT_COUNT(rwlock_p, process_state_p, phase_fair_readers_waiting_count);
+			else if(preferring == ADAPTIVE_PREFERRING)
+				INCREMENT_COUNT(rwlock_p, process_state_p, adaptive_readers_waiting_count);
+			wait_error = timedwait_on_rwlock(rwlock_p, (preferring == ADAPTIVE_PREFERRING) ? &(rwlock_p->adaptive_read_wait) : &(rwlock_p->read_wait), &timeout_in_microseconds);
+			DECREMENT_COUNT(rwlock_p, process_state_p, readers_waiting_count);
+			if(preferring == PHASE_FAIR)
+				DECREMENT_COUNT(rwlock_p, process_state_p, phase_fair_readers_waiting_count);
+			else if(preferring == ADAPTIVE_PREFERRING)
+				DECREMENT_COUNT(rwlock_p, process_state_p, adaptive_readers_waiting_count);
 		}
+
+		// an entitled PHASE_FAIR reader is done waiting, so it no longer holds back the waiting writers
+		// it never times out, as no writer (or upgrader) can take the lock before it enters, the writers and the upgrader get woken up when it releases the lock
+		if(preferring == PHASE_FAIR && is_phase_fair_reader_entitled(rwlock_p, arrival_write_phase))
+			DECREMENT_COUNT(rwlock_p, process_state_p, phase_fair_readers_entitled_count);
 	}
 
+	// the external_lock was held by a dead process, its waiters get woken up when the caller recovers it
+	if(wait_error == EOWNERDEAD)
+		goto EXIT;
+
 	// if you can grab a lock, then grab it, else fail
-	if(can_grab_read_lock(rwlock_p, preferring))
+	if(can_grab_read_lock(rwlock_p, preferring, arrival_write_phase))
 	{
-		rwlock_p->readers_count++;
+		INCREMENT_COUNT(rwlock_p, process_state_p, readers_count);
 		res = 1;
+
+		// keep track of the adaptive readers that bypassed the waiting writers
+		if(preferring == ADAPTIVE_PREFERRING)
+		{
+			if(are_writers_waiting(rwlock_p))
+				rwlock_p->readers_bypassing_writers_count++;
+			else
+				rwlock_p->readers_bypassing_writers_count = 0;
+		}
 	}
 
+	EXIT:;
+	put_process_state(process_state_p);
+
+	return res;
+}
+
+int read_lock(rwlock* rwlock_p, lock_preferring_type preferring, uint64_t timeout_in_microseconds)
+{
+	if(rwlock_p->has_internal_lock)
+		lock_rwlock_lock(rwlock_p);
+
+	count_arrival(rwlock_p, RWLOCK_READ_MODE);
+	int res = read_lock_UNSAFE(rwlock_p, preferring, timeout_in_microseconds);
+
 	if(rwlock_p->has_internal_lock)
 		pthread_mutex_unlock(get_rwlock_lock(rwlock_p));
 
@@ -83,40 +500,63 @@ int read_lock(rwlock* rwlock_p, lock_preferring_type preferring, uint64_t timeou
 static inline int can_grab_write_lock(const rwlock* rwlock_p)
 {
 	// a write lock can only be grabbed if there are no active readers and writers
-	return (rwlock_p->readers_count == 0) && (rwlock_p->writers_count == 0);
+	// and if there are no PHASE_FAIR readers still to enter the current read phase
+	return (rwlock_p->readers_count == 0) && (rwlock_p->writers_count == 0) && (rwlock_p->phase_fair_readers_entitled_count == 0);
 }
 
-int write_lock(rwlock* rwlock_p, uint64_t timeout_in_microseconds)
+static int write_lock_UNSAFE(rwlock* rwlock_p, uint64_t timeout_in_microseconds)
 {
 	int res = 0;
 	int was_blocked = 0;
 
-	if(rwlock_p->has_internal_lock)
-		pthread_mutex_lock(get_rwlock_lock(rwlock_p));
+	rwlock_process_state* process_state_p = NULL;
+	if(!ACQUIRE_PROCESS_STATE(rwlock_p, process_state_p))
+		goto EXIT;
 
+	int wait_error = 0;
 	if(timeout_in_microseconds != NON_BLOCKING) // you can block only if timeout_in_microsecond != NON_BLOCKING
 	{
-		int wait_error = 0;
+		uint64_t wait_start = 0;
 		while(!can_grab_write_lock(rwlock_p) && !wait_error) // block while you can not grab lock and there is no wait error
 		{
-			rwlock_p->writers_waiting_count++;
-			wait_error = pthread_cond_timedwait_for_microseconds(&(rwlock_p->write_wait), get_rwlock_lock(rwlock_p), &timeout_in_microseconds);
+			start_writer_wait(rwlock_p, &wait_start);
+			INCREMENT_COUNT(rwlock_p, process_state_p, writers_waiting_count);
+			wait_error = timedwait_on_rwlock(rwlock_p, &(rwlock_p->write_wait), &timeout_in_microseconds);
 			was_blocked = 1; // we were just blocked in the line above
-			rwlock_p->writers_waiting_count--;
+			DECREMENT_COUNT(rwlock_p, process_state_p, writers_waiting_count);
 		}
 	}
 
+	// the external_lock was held by a dead process, its waiters get woken up when the caller recovers it
+	if(wait_error == EOWNERDEAD)
+		goto EXIT;
+
 	if(can_grab_write_lock(rwlock_p))
 	{
-		rwlock_p->writers_count++;
+		INCREMENT_COUNT(rwlock_p, process_state_p, writers_count);
+		grant_writer(rwlock_p);
 		res = 1;
 	}
 	else
 	{
-		if(was_blocked) // while we were blocked some write preferring readers could have gone to wait, so we just wake them up, we do this if we were blocked atleast once
-			pthread_cond_broadcast(&(rwlock_p->read_wait));
+		if(was_blocked) // while we were blocked some write preferring (or adaptive) readers could have gone to wait, so we just wake them up, we do this if we were blocked atleast once
+			wake_up_readers(rwlock_p);
 	}
 
+	EXIT:;
+	put_process_state(process_state_p);
+
+	return res;
+}
+
+int write_lock(rwlock* rwlock_p, uint64_t timeout_in_microseconds)
+{
+	if(rwlock_p->has_internal_lock)
+		lock_rwlock_lock(rwlock_p);
+
+	count_arrival(rwlock_p, RWLOCK_WRITE_MODE);
+	int res = write_lock_UNSAFE(rwlock_p, timeout_in_microseconds);
+
 	if(rwlock_p->has_internal_lock)
 		pthread_mutex_unlock(get_rwlock_lock(rwlock_p));
 
@@ -128,24 +568,31 @@ int downgrade_lock(rwlock* rwlock_p)
 	int res = 0;
 
 	if(rwlock_p->has_internal_lock)
-		pthread_mutex_lock(get_rwlock_lock(rwlock_p));
+		lock_rwlock_lock(rwlock_p);
+
+	rwlock_process_state* process_state_p = NULL;
+	if(!ACQUIRE_PROCESS_STATE(rwlock_p, process_state_p))
+		goto EXIT;
 
-	// make sure that the resource is write locked
-	if(rwlock_p->writers_count == 0)
+	// make sure that the resource is write locked (by this process, if it is process shared)
+	if(rwlock_p->writers_count == 0 || (process_state_p != NULL && process_state_p->writers_count == 0))
 		goto EXIT;
 
 	// decrement the writers_count, increment readers_count, releasing converting a read lock to a write lock
-	rwlock_p->writers_count--;
-	rwlock_p->readers_count++;
+	DECREMENT_COUNT(rwlock_p, process_state_p, writers_count);
+	INCREMENT_COUNT(rwlock_p, process_state_p, readers_count);
+	end_write_phase(rwlock_p);
 	res = 1;
 
 	// since before this call I was a writer, there can not be any upgraders waiting in the system
 
 	// so we only need to wake up readers
 	if(rwlock_p->readers_waiting_count > 0)
-		pthread_cond_broadcast(&(rwlock_p->read_wait));
+		wake_up_readers(rwlock_p);
 
 	EXIT:;
+	put_process_state(process_state_p);
+
 	if(rwlock_p->has_internal_lock)
 		pthread_mutex_unlock(get_rwlock_lock(rwlock_p));
 
@@ -157,7 +604,8 @@ int downgrade_lock(rwlock* rwlock_p)
 static inline int can_upgrade_lock(const rwlock* rwlock_p)
 {
 	// you can go ahead with upgrading the reader lock held into a writer lock, only if we are the sole person holding the reader lock
-	return (rwlock_p->readers_count == 1);
+	// and if there are no PHASE_FAIR readers still to enter the current read phase, an upgrader waits for them just like a writer does
+	return (rwlock_p->readers_count == 1) && (rwlock_p->phase_fair_readers_entitled_count == 0);
 }
 
 int upgrade_lock(rwlock* rwlock_p, uint64_t timeout_in_microseconds)
@@ -166,57 +614,71 @@ int upgrade_lock(rwlock* rwlock_p, uint64_t timeout_in_microseconds)
 	int was_blocked = 0;
 
 	if(rwlock_p->has_internal_lock)
-		pthread_mutex_lock(get_rwlock_lock(rwlock_p));
+		lock_rwlock_lock(rwlock_p);
+
+	rwlock_process_state* process_state_p = NULL;
+	if(!ACQUIRE_PROCESS_STATE(rwlock_p, process_state_p))
+		goto EXIT;
 
 	// you can not be holding a reader lock (assumed since you want to upgrade), if there are active writers
 	if(rwlock_p->writers_count > 0)
 		goto EXIT;
 
-	// there are not read locks issued, so you can not be holding a reader lock
-	if(rwlock_p->readers_count == 0)
+	// there are not read locks issued (by this process, if it is process shared), so you can not be holding a reader lock
+	if(rwlock_p->readers_count == 0 || (process_state_p != NULL && process_state_p->readers_count == 0))
 		goto EXIT;
 
 	// we can not even wait to upgrade the lock, if there is someone else aswell wanting to upgrade the lock
 	if(rwlock_p->upgraders_waiting_count > 0)
 		goto EXIT;
 
+	int wait_error = 0;
 	if(timeout_in_microseconds != NON_BLOCKING) // you can block only if timeout_in_microsecond != NON_BLOCKING
 	{
-		int wait_error = 0;
+		uint64_t wait_start = 0;
 		while(!can_upgrade_lock(rwlock_p) && !wait_error) // block while you can not grab lock and there is no wait error
 		{
-			rwlock_p->upgraders_waiting_count++;
-			wait_error = pthread_cond_timedwait_for_microseconds(&(rwlock_p->upgrade_wait), get_rwlock_lock(rwlock_p), &timeout_in_microseconds);
+			start_writer_wait(rwlock_p, &wait_start);
+			INCREMENT_COUNT(rwlock_p, process_state_p, upgraders_waiting_count);
+			wait_error = timedwait_on_rwlock(rwlock_p, &(rwlock_p->upgrade_wait), &timeout_in_microseconds);
 			was_blocked = 1; // we were just blocked in the line above
-			rwlock_p->upgraders_waiting_count--;
+			DECREMENT_COUNT(rwlock_p, process_state_p, upgraders_waiting_count);
 		}
 	}
 
+	// the external_lock was held by a dead process, its waiters get woken up when the caller recovers it
+	if(wait_error == EOWNERDEAD)
+		goto EXIT;
+
 	if(can_upgrade_lock(rwlock_p))
 	{
-		rwlock_p->readers_count--;
-		rwlock_p->writers_count++;
+		DECREMENT_COUNT(rwlock_p, process_state_p, readers_count);
+		INCREMENT_COUNT(rwlock_p, process_state_p, writers_count);
+		grant_writer(rwlock_p);
 		res = 1;
 	}
 	else
 	{
-		if(was_blocked) // while we were blocked some write preferring readers could have gone to wait, so we just wake them up, we do this if we were blocked atleast once
-			pthread_cond_broadcast(&(rwlock_p->read_wait));
+		if(was_blocked) // while we were blocked some write preferring (or adaptive) readers could have gone to wait, so we just wake them up, we do this if we were blocked atleast once
+			wake_up_readers(rwlock_p);
 	}
 
 	EXIT:;
+	put_process_state(process_state_p);
+
 	if(rwlock_p->has_internal_lock)
 		pthread_mutex_unlock(get_rwlock_lock(rwlock_p));
 
 	return res;
 }
 
-int read_unlock(rwlock* rwlock_p)
+static int read_unlock_UNSAFE(rwlock* rwlock_p)
 {
 	int res = 0;
 
-	if(rwlock_p->has_internal_lock)
-		pthread_mutex_lock(get_rwlock_lock(rwlock_p));
+	rwlock_process_state* process_state_p = NULL;
+	if(!ACQUIRE_PROCESS_STATE(rwlock_p, process_state_p))
+		goto EXIT;
 
 	// make sure that the resource is read locked
 	// by default logic rwlock_p->readers_count >= rwlock_p->upgraders_waiting_count
@@ -224,45 +686,353 @@ int read_unlock(rwlock* rwlock_p)
 	if(rwlock_p->readers_count == rwlock_p->upgraders_waiting_count)
 		goto EXIT;
 
+	// same check for the readers of this process, if it is process shared
+	if(process_state_p != NULL && process_state_p->readers_count == process_state_p->upgraders_waiting_count)
+		goto EXIT;
+
 	// decrement the readers_count, releasing read lock
-	rwlock_p->readers_count--;
+	DECREMENT_COUNT(rwlock_p, process_state_p, readers_count);
 	res = 1;
 
 	// wake up any waiters (upgraders, writers or any possible waiting readers), only if this is the last reader thread
 	if(rwlock_p->readers_count == 1 && rwlock_p->upgraders_waiting_count > 0)
-		pthread_cond_signal(&(rwlock_p->upgrade_wait));
+		signal_rwlock_waiter(rwlock_p, &(rwlock_p->upgrade_wait));
 	else if(rwlock_p->readers_count == 0 && rwlock_p->writers_waiting_count > 0)
-		pthread_cond_signal(&(rwlock_p->write_wait));
+		wake_up_writer(rwlock_p);
 	else if(rwlock_p->readers_count == 0 && rwlock_p->readers_waiting_count > 0) // this is redundant, since readers will never wait if there are no writers or upgraders waiting
-		pthread_cond_broadcast(&(rwlock_p->read_wait));
+		wake_up_readers(rwlock_p);
 
 	EXIT:;
+	put_process_state(process_state_p);
+
+	return res;
+}
+
+int read_unlock(rwlock* rwlock_p)
+{
+	if(rwlock_p->has_internal_lock)
+		lock_rwlock_lock(rwlock_p);
+
+	int res = read_unlock_UNSAFE(rwlock_p);
+
 	if(rwlock_p->has_internal_lock)
 		pthread_mutex_unlock(get_rwlock_lock(rwlock_p));
 
 	return res;
 }
 
+// the write lock must be held, and so must be the rwlock's mutex
+static inline void release_write_lock(rwlock* rwlock_p, rwlock_process_state* process_state_p)
+{
+	// decrement the writers_count, releasing write lock
+	DECREMENT_COUNT(rwlock_p, process_state_p, writers_count);
+	end_write_phase(rwlock_p);
+
+	// wake up any waiters, a writer will always prefer a writer to have the lock
+	// unless there are PHASE_FAIR readers waiting, then the read phase begins, and the writers are woken up when it ends
+	if(rwlock_p->phase_fair_readers_entitled_count > 0)
+		wake_up_readers(rwlock_p);
+	else if(rwlock_p->writers_waiting_count > 0)
+	{
+		wake_up_writer(rwlock_p);
+		wake_up_bypassing_adaptive_readers(rwlock_p); // they compete with the woken up writer for the lock
+	}
+	else if(rwlock_p->readers_waiting_count > 0)
+		wake_up_readers(rwlock_p);
+}
+
+static int write_unlock_UNSAFE(rwlock* rwlock_p)
+{
+	int res = 0;
+
+	rwlock_process_state* process_state_p = NULL;
+	if(!ACQUIRE_PROCESS_STATE(rwlock_p, process_state_p))
+		goto EXIT;
+
+	// make sure that the resource is write locked (by this process, if it is process shared)
+	if(rwlock_p->writers_count == 0 || (process_state_p != NULL && process_state_p->writers_count == 0))
+		goto EXIT;
+
+	release_write_lock(rwlock_p, process_state_p);
+	res = 1;
+
+	EXIT:;
+	put_process_state(process_state_p);
+
+	return res;
+}
+
 int write_unlock(rwlock* rwlock_p)
 {
+	if(rwlock_p->has_internal_lock)
+		lock_rwlock_lock(rwlock_p);
+
+	int res = write_unlock_UNSAFE(rwlock_p);
+
+	if(rwlock_p->has_internal_lock)
+		pthread_mutex_unlock(get_rwlock_lock(rwlock_p));
+
+	return res;
+}
+
+static inline int lock_in_mode_UNSAFE(rwlock* rwlock_p, rwlock_mode mode, lock_preferring_type preferring, uint64_t timeout_in_microseconds)
+{
+	if(mode == RWLOCK_READ_MODE)
+		return read_lock_UNSAFE(rwlock_p, preferring, timeout_in_microseconds);
+	else
+		return write_lock_UNSAFE(rwlock_p, timeout_in_microseconds);
+}
+
+static inline int unlock_in_mode_UNSAFE(rwlock* rwlock_p, rwlock_mode mode)
+{
+	if(mode == RWLOCK_READ_MODE)
+		return read_unlock_UNSAFE(rwlock_p);
+	else
+		return write_unlock_UNSAFE(rwlock_p);
+}
+
+// returns the mutex that this call must lock for the rwlock, NULL if it has an external_lock (that the caller holds)
+static inline pthread_mutex_t* get_rwlock_internal_lock(rwlock* rwlock_p)
+{
+	return rwlock_p->has_internal_lock ? &(rwlock_p->internal_lock) : NULL;
+}
+
+int couple_rwlock(rwlock* child_p, rwlock_mode child_mode, lock_preferring_type child_preferring, rwlock* parent_p, rwlock_mode parent_mode, int release_parent_before_blocking, uint64_t timeout_in_microseconds)
+{
+	int res = 0;
+
+	pthread_mutex_t* child_lock = get_rwlock_internal_lock(child_p);
+	pthread_mutex_t* parent_lock = get_rwlock_internal_lock(parent_p);
+
+	// take both the internal locks, in the order of their addresses, so that the concurrent couplings (in any direction) can not deadlock
+	if(child_lock != NULL && parent_lock != NULL && parent_lock < child_lock)
+	{
+		lock_rwlock_lock(parent_p);
+		lock_rwlock_lock(child_p);
+	}
+	else
+	{
+		if(child_lock != NULL)
+			lock_rwlock_lock(child_p);
+		if(parent_lock != NULL)
+			lock_rwlock_lock(parent_p);
+	}
+
+	count_arrival(child_p, child_mode);
+
+	// with both of them held, lock the child and release the parent together, if the child is available
+	res = lock_in_mode_UNSAFE(child_p, child_mode, child_preferring, NON_BLOCKING);
+	if(res || release_parent_before_blocking)
+		unlock_in_mode_UNSAFE(parent_p, parent_mode);
+
+	// we must not be holding the parent's internal lock, while we block for the child
+	if(parent_lock != NULL)
+		pthread_mutex_unlock(parent_lock);
+
+	int parent_to_be_released = 0;
+	if(!res && timeout_in_microseconds != NON_BLOCKING)
+	{
+		res = lock_in_mode_UNSAFE(child_p, child_mode, child_preferring, timeout_in_microseconds);
+		parent_to_be_released = res && !release_parent_before_blocking;
+	}
+
+	// the child got locked after blocking, and we are still holding the parent, so release it now
+	// it needs the parent's internal lock, which can be taken only without blocking, while we still hold the child's internal lock
+	if(parent_to_be_released && parent_lock != NULL && trylock_rwlock_lock(parent_p))
+	{
+		unlock_in_mode_UNSAFE(parent_p, parent_mode);
+		pthread_mutex_unlock(parent_lock);
+		parent_to_be_released = 0;
+	}
+
+	if(child_lock != NULL)
+		pthread_mutex_unlock(child_lock);
+
+	// fallback, release the parent, after releasing the child's internal lock
+	if(parent_to_be_released)
+	{
+		if(parent_lock != NULL)
+			lock_rwlock_lock(parent_p);
+		unlock_in_mode_UNSAFE(parent_p, parent_mode);
+		if(parent_lock != NULL)
+			pthread_mutex_unlock(parent_lock);
+	}
+
+	return res;
+}
+
+int execute_with_read_lock(rwlock* rwlock_p, lock_preferring_type preferring, rwlock_closure* closure_p, uint64_t timeout_in_microseconds)
+{
+	if(!read_lock(rwlock_p, preferring, timeout_in_microseconds))
+		return 0;
+
+	// read closures run concurrently, so do not hold the external_lock while executing it
+	if(!rwlock_p->has_internal_lock)
+		pthread_mutex_unlock(get_rwlock_lock(rwlock_p));
+
+	closure_p->result = closure_p->function(closure_p->args);
+
+	// the closure was executed, so even if the external_lock was held by a dead owner, we still succeed, but with the errno set
+	if(!rwlock_p->has_internal_lock)
+		relock_external_lock(rwlock_p);
+
+	read_unlock(rwlock_p);
+
+	return 1;
+}
+
+static inline void append_closure(rwlock* rwlock_p, rwlock_closure* closure_p)
+{
+	closure_p->next = NULL;
+	if(rwlock_p->closures_tail == NULL)
+		rwlock_p->closures_head = closure_p;
+	else
+		rwlock_p->closures_tail->next = closure_p;
+	rwlock_p->closures_tail = closure_p;
+}
+
+static inline void remove_closure(rwlock* rwlock_p, rwlock_closure* closure_p)
+{
+	rwlock_closure* prev = NULL;
+	for(rwlock_closure* curr = rwlock_p->closures_head; curr != NULL; prev = curr, curr = curr->next)
+	{
+		if(curr != closure_p)
+			continue;
+
+		if(prev == NULL)
+			rwlock_p->closures_head = curr->next;
+		else
+			prev->next = curr->next;
+		if(rwlock_p->closures_tail == curr)
+			rwlock_p->closures_tail = prev;
+		return;
+	}
+}
+
+// the calling thread holds the rwlock's mutex, and can grab the write lock
+// it becomes the combiner, and executes the published closures in batches, with the rwlock's mutex released
+static void combine_closures(rwlock* rwlock_p, rwlock_closure* own_closure_p)
+{
+	rwlock_p->writers_count++;
+	grant_writer(rwlock_p);
+
+	int is_lock_consistent = 1;
+
+	for(uint64_t rounds = 0; is_lock_consistent && rounds < RWLOCK_MAX_COMBINING_ROUNDS && rwlock_p->closures_head != NULL; rounds++)
+	{
+		// take all the published closures, as a batch
+		rwlock_closure* batch = rwlock_p->closures_head;
+		rwlock_p->closures_head = NULL;
+		rwlock_p->closures_tail = NULL;
+		for(rwlock_closure* c = batch; c != NULL; c = c->next)
+			c->is_taken = 1;
+
+		pthread_mutex_unlock(get_rwlock_lock(rwlock_p));
+
+		for(rwlock_closure* c = batch; c != NULL; c = c->next)
+			c->result = c->function(c->args);
+
+		// an external_lock held by a dead owner, must not be released again before the caller recovers it, so we stop combining after this batch
+		if(rwlock_p->has_internal_lock)
+			lock_rwlock_lock(rwlock_p);
+		else
+			is_lock_consistent = relock_external_lock(rwlock_p);
+
+		// hand over the results, the closure may not be accessed after it is marked done, as its thread may then return
+		while(batch != NULL)
+		{
+			rwlock_closure* c = batch;
+			batch = batch->next;
+			c->is_done = 1;
+			if(c != own_closure_p)
+				pthread_cond_signal(&(c->wait));
+		}
+	}
+
+	release_write_lock(rwlock_p, NULL);
+}
+
+int execute_with_write_lock(rwlock* rwlock_p, rwlock_closure* closure_p, uint64_t timeout_in_microseconds)
+{
+	// the published closures of one process can not be executed by a combiner of another process
+	if(rwlock_p->is_process_shared)
+		return 0;
+
 	int res = 0;
+	int was_blocked = 0;
 
 	if(rwlock_p->has_internal_lock)
-		pthread_mutex_lock(get_rwlock_lock(rwlock_p));
+		lock_rwlock_lock(rwlock_p);
+
+	// it is a write_lock call, for the ADAPTIVE_PREFERRING readers
+	count_arrival(rwlock_p, RWLOCK_WRITE_MODE);
+
+	closure_p->is_taken = 0;
+	closure_p->is_done = 0;
+
+	// uncontended, so we just become the combiner, executing our closure (and any other published ones)
+	if(can_grab_write_lock(rwlock_p))
+	{
+		append_closure(rwlock_p, closure_p);
+		combine_closures(rwlock_p, closure_p);
+		res = 1;
+		goto EXIT;
+	}
 
-	// make sure that the resource is write locked
-	if(rwlock_p->writers_count == 0)
+	// you can block only if timeout_in_microsecond != NON_BLOCKING
+	if(timeout_in_microseconds == NON_BLOCKING)
 		goto EXIT;
 
-	// decrement the writers_count, releasing write lock
-	rwlock_p->writers_count--;
-	res = 1;
+	// publish the closure, and wait for either a combiner to execute it, or for the lock to be free to become the combiner ourselves
+	pthread_cond_init_with_monotonic_clock(&(closure_p->wait));
+	append_closure(rwlock_p, closure_p);
 
-	// wake up any waiters, a writer will always prefer a writer to have the lock
-	if(rwlock_p->writers_waiting_count > 0)
-		pthread_cond_signal(&(rwlock_p->write_wait));
-	else if(rwlock_p->readers_waiting_count > 0)
-		pthread_cond_broadcast(&(rwlock_p->read_wait));
+	int wait_error = 0;
+	uint64_t wait_start = 0;
+	while(!closure_p->is_done)
+	{
+		if(!closure_p->is_taken)
+		{
+			if(wait_error == EOWNERDEAD) // the external_lock was held by a dead process, so fail for the caller to recover it
+			{
+				remove_closure(rwlock_p, closure_p);
+				break;
+			}
+
+			if(can_grab_write_lock(rwlock_p))
+			{
+				combine_closures(rwlock_p, closure_p);
+				break;
+			}
+
+			if(wait_error) // timed out, before any combiner could take our closure
+			{
+				remove_closure(rwlock_p, closure_p);
+				break;
+			}
+
+			start_writer_wait(rwlock_p, &wait_start);
+			rwlock_p->writers_waiting_count++;
+			wait_error = timedwait_on_rwlock(rwlock_p, &(closure_p->wait), &timeout_in_microseconds);
+			was_blocked = 1; // we were just blocked in the line above
+			rwlock_p->writers_waiting_count--;
+		}
+		else
+		{
+			// a combiner is executing our closure, it can not be cancelled now, so we wait for it irrespective of the timeout
+			// the combiner needs the external_lock to hand over our result, so only here it is made consistent, if it was held by a dead owner (the errno stays set for the caller)
+			uint64_t blocking = BLOCKING;
+			if(timedwait_on_rwlock(rwlock_p, &(closure_p->wait), &blocking) == EOWNERDEAD)
+				pthread_mutex_consistent(get_rwlock_lock(rwlock_p));
+		}
+	}
+
+	pthread_cond_destroy(&(closure_p->wait));
+
+	res = closure_p->is_done;
+
+	if(!res && was_blocked) // while we were blocked some write preferring (or adaptive) readers could have gone to wait, so we just wake them up
+		wake_up_readers(rwlock_p);
 
 	EXIT:;
 	if(rwlock_p->has_internal_lock)
@@ -274,7 +1044,7 @@ int write_unlock(rwlock* rwlock_p)
 int is_read_locked(rwlock* rwlock_p)
 {
 	if(rwlock_p->has_internal_lock)
-		pthread_mutex_lock(get_rwlock_lock(rwlock_p));
+		lock_rwlock_lock(rwlock_p);
 
 	int res = (rwlock_p->readers_count > 0);
 
@@ -287,7 +1057,7 @@ int is_read_locked(rwlock* rwlock_p)
 int is_write_locked(rwlock* rwlock_p)
 {
 	if(rwlock_p->has_internal_lock)
-		pthread_mutex_lock(get_rwlock_lock(rwlock_p));
+		lock_rwlock_lock(rwlock_p);
 
 	int res = (rwlock_p->writers_count > 0);
 
@@ -300,7 +1070,7 @@ int is_write_locked(rwlock* rwlock_p)
 int has_rwlock_waiters(rwlock* rwlock_p)
 {
 	if(rwlock_p->has_internal_lock)
-		pthread_mutex_lock(get_rwlock_lock(rwlock_p));
+		lock_rwlock_lock(rwlock_p);
 
 	int res = (rwlock_p->readers_waiting_count > 0) ||
 				(rwlock_p->writers_waiting_count > 0) ||
@@ -315,7 +1085,7 @@ int has_rwlock_waiters(rwlock* rwlock_p)
 int is_rwlock_referenced(rwlock* rwlock_p)
 {
 	if(rwlock_p->has_internal_lock)
-		pthread_mutex_lock(get_rwlock_lock(rwlock_p));
+		lock_rwlock_lock(rwlock_p);
 
 	int res = (rwlock_p->readers_count > 0) ||
 				(rwlock_p->writers_count > 0) ||